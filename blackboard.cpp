@@ -6,9 +6,48 @@
 #include <cctype> 
 #include <sstream>
 #include <map>
+#include <variant>
 #include <algorithm>
+#include <string_view>
+#include <charconv>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <shared_mutex>
+#include <condition_variable>
+#include <csignal>
+#ifdef BLACKBOARD_BENCH
+#include <random>
+#endif
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <cassert>
 using namespace std;
 
+// Where command output goes: stdout and stderr in a terminal session, the reply to the client while a server
+// worker runs one of its commands.
+thread_local ostream* console_stream = &cout;
+thread_local ostream* console_error_stream = &cerr;
+
+inline ostream& console() { return *console_stream; }
+inline ostream& console_error() { return *console_error_stream; }
+
 #define RED    "\033[31m"
 #define GREEN  "\033[32m"
 #define BLUE   "\033[34m"
@@ -20,884 +59,5490 @@ using namespace std;
 #define PURPLE "\033[35m"
 #define RESET  "\033[0m"
 
-class Cell;
-
-class Figure{
-public:
-    static int id;
-
-    virtual ~Figure() { id--; }
+struct NamedColor{
+    const char* name;
+    char symbol;
+    const char* code;
+};
 
-    virtual void add(vector<vector<weak_ptr<Cell>>>* grid) = 0;
-    virtual const string get_info() = 0;
-    virtual const bool get_placement() = 0;
-    virtual bool operator==(const Figure& other) const = 0;
-    virtual char get_symbol() const = 0;
-    virtual const char* get_color() const = 0;
-    virtual int get_id() const = 0;
-    virtual string get_type() const = 0;
-    virtual void set_color(pair<char, const char*> color) = 0;
+// Colors known at compile time; the position is the 1-byte index stored in figures, cells and snapshots, so
+// entries are only ever appended. Index 0 is the terminal default.
+constexpr NamedColor NAMED_COLORS[] = {
+    {"", ' ', RESET}, {"red", 'r', RED}, {"green", 'g', GREEN}, {"blue", 'b', BLUE}, {"yellow", 'y', YELLOW},
+    {"black", 'k', BLACK}, {"white", 'w', WHITE}, {"cyan", 'c', CYAN}, {"magenta", 'm', MAGENTA}, {"purple", 'p', PURPLE}
 };
+constexpr uint8_t NAMED_COUNT = sizeof(NAMED_COLORS) / sizeof(NAMED_COLORS[0]);
 
-int Figure::id = 0;
+constexpr uint8_t named_color(const string_view& name){
+    for (uint8_t i = 1; i < NAMED_COUNT; i++){
+        if (name == NAMED_COLORS[i].name) return i;
+    }
+    return 0;
+}
 
-class Cell{
-private:
-    vector<Figure*> figures;
-    char symbol;
-    const char* color;
+// Every color in use, by 1-byte index: the named colors, followed by 256-color (`color0`..`color255`) and
+// truecolor (`#rrggbb`) entries registered the first time a command names them. Names are resolved once when
+// a command is parsed; after that figures, cells and the renderer only pass the index around. Extended entries
+// no figure uses any more are released when the board is cleared or loaded, and their slots named again.
+class Palette{
 public:
-    Cell(const char* symbol, const char* color) : symbol(*symbol), color(color) {}
+    // 0xFF is left free for the renderer's "no color yet" state.
+    static const size_t CAPACITY = 255;
+    static const char EXTENDED_SYMBOL = '*';
 
-    void addFigure(Figure* figure) {
-        figures.push_back(figure);
-    }
+private:
+    struct Entry{
+        string name;
+        char symbol;
+        string code;
+    };
 
-    Figure* lastFigure(){
-        if(!figures.empty()){
-            return figures.back();
+    Entry entries[CAPACITY];
+    atomic<size_t> count{0};
+    unordered_map<string, uint8_t> extended;
+    // Extended slots are live, retired by release() while frozen versions may still name them, or free again.
+    enum SlotState : uint8_t { Live, Retired, Free };
+    SlotState states[CAPACITY] = {};
+    // Figures outside the board that use each slot; see Hold.
+    uint32_t holds[CAPACITY] = {};
+    // Slots retired together, with the count of leases taken before, which must drop to 0 before they are freed.
+    struct Retirement{
+        shared_ptr<atomic<int>> leases;
+        vector<uint8_t> slots;
+    };
+    vector<Retirement> retired;
+    shared_ptr<atomic<int>> epoch = make_shared<atomic<int>>(0);
+    // resolve() hands these out before taking new slots.
+    vector<uint8_t> free_slots;
+    mutex lock;
+
+    // Frees the retired slots no lease keeps any more.
+    void collect(){
+        auto kept = retired.begin();
+        for (auto& retirement : retired){
+            if (retirement.leases->load(memory_order_acquire) != 0){
+                *kept++ = move(retirement);
+                continue;
+            }
+            for (uint8_t slot : retirement.slots){
+                states[slot] = Free;
+                free_slots.push_back(slot);
+            }
         }
-        return nullptr;
+        retired.erase(kept, retired.end());
     }
-    
-    char get_symbol(){
-        return figures.back()->get_symbol();
+
+    Palette(){
+        for (const NamedColor& color : NAMED_COLORS){
+            entries[count++] = {color.name, color.symbol, color.code};
+        }
     }
 
-    const char* get_color(){
-        return figures.back()->get_color();
+    static int hex(const char& digit){
+        if (digit >= '0' && digit <= '9') return digit - '0';
+        if (digit >= 'a' && digit <= 'f') return digit - 'a' + 10;
+        if (digit >= 'A' && digit <= 'F') return digit - 'A' + 10;
+        return -1;
     }
-};
 
-class Square: public Figure{
-private: 
-    int size;
-    int s_id;
-    tuple<int,int> coordinates; // coordinates of square top_left
-    bool if_outside;
-    pair<char, const char*> color;
-    char display_char;
-    const char* display_color;
-    vector<shared_ptr<Cell>> occupiedCells;
-    bool fill;
+    // Escape sequence for an extended color name, or an empty string if the name is not one.
+    static string escape(const string_view& name){
+        if (name.size() == 7 && name[0] == '#'){
+            int rgb[3];
+            for (int i = 0; i < 3; i++){
+                int high = hex(name[1 + 2 * i]);
+                int low = hex(name[2 + 2 * i]);
+                if (high < 0 || low < 0) return "";
+                rgb[i] = high * 16 + low;
+            }
+            return "\033[38;2;" + to_string(rgb[0]) + ';' + to_string(rgb[1]) + ';' + to_string(rgb[2]) + 'm';
+        }
+        int number;
+        if (name.size() > 5 && name.substr(0, 5) == "color"){
+            auto result = from_chars(name.data() + 5, name.data() + name.size(), number);
+            if (result.ec == errc() && result.ptr == name.data() + name.size() && number >= 0 && number <= 255
+                && (name.size() == 6 || name[5] != '0')){
+                return "\033[38;5;" + to_string(number) + 'm';
+            }
+        }
+        return "";
+    }
 
 public:
-    Square(bool fill, pair<char, const char*> color, const int& size, const int& x, const int& y): size(size), coordinates(make_tuple(x,y)), s_id(id++),
-     display_char(color.first), display_color(color.second), fill(fill) { }
-
-    Square(Square&& other, const int& new_size) : size(new_size), coordinates(std::move(other.coordinates)), s_id(other.s_id),
-     display_char(other.display_char), display_color(other.display_color), fill(other.fill) 
-    {
-        other.size = 0;
+    static Palette& instance(){
+        static Palette palette;
+        return palette;
     }
 
-    void add(vector<vector<weak_ptr<Cell>>>* grid) override{
-        if (size <= 0){
-            cerr << "Please, provide positive numbers for size\n";
-            return;
-        } 
+    // Index of a color name, registering extended colors on first use. Fails for unknown names and once all
+    // slots are taken, so a typo never adds an entry.
+    bool resolve(const string_view& name, uint8_t& index){
+        uint8_t named = named_color(name);
+        if (named != 0){
+            index = named;
+            return true;
+        }
+        string code = escape(name);
+        if (code.empty()){
+            return false;
+        }
+        string key(name);
+        transform(key.begin(), key.end(), key.begin(), [](unsigned char c){ return tolower(c); });
+
+        lock_guard<mutex> guard(lock);
+        auto found = extended.find(key);
+        if (found != extended.end()){
+            index = found->second;
+            return true;
+        }
+        if (free_slots.empty()){
+            collect();
+        }
+        if (!free_slots.empty()){
+            index = free_slots.back();
+            free_slots.pop_back();
+            entries[index] = {key, EXTENDED_SYMBOL, code};
+            states[index] = Live;
+            extended[key] = index;
+            return true;
+        }
+        if (count == CAPACITY){
+            return false;
+        }
+        entries[count] = {key, EXTENDED_SYMBOL, code};
+        index = extended[key] = count;
+        count++;
+        return true;
+    }
 
-        int x = get<0>(coordinates); 
-        int y = get<1>(coordinates); 
+    // Taken with each frozen version: slots retired while it is held stay out of reach of resolve(), since the
+    // version may still draw or save with them.
+    class Lease{
+    private:
+        shared_ptr<atomic<int>> leases;
+    public:
+        Lease(){
+            Palette& palette = instance();
+            lock_guard<mutex> guard(palette.lock);
+            leases = palette.epoch;
+            leases->fetch_add(1, memory_order_relaxed);
+        }
+        Lease(const Lease& other) : leases(other.leases) {
+            leases->fetch_add(1, memory_order_relaxed);
+        }
+        Lease& operator=(const Lease&) = delete;
+        ~Lease(){
+            leases->fetch_sub(1, memory_order_release);
+        }
+    };
 
-        int up_bound = grid[0].size();
-        int right_bound = grid[0][0].size();
+    // Keeps the colors of figures built outside the board, like those of an open batch, from being released.
+    class Hold{
+    private:
+        vector<uint8_t> colors;
+    public:
+        Hold() = default;
+        Hold(Hold&&) = default;
+        Hold& operator=(Hold&&) = delete;
+        ~Hold(){ clear(); }
+
+        void add(const uint8_t& color){
+            if (is_named(color)) return;
+            Palette& palette = instance();
+            lock_guard<mutex> guard(palette.lock);
+            palette.holds[color]++;
+            colors.push_back(color);
+        }
 
-        if_outside = y+size > up_bound || y < 0 || x + size < 0 || x > right_bound; 
+        void clear(){
+            if (colors.empty()) return;
+            Palette& palette = instance();
+            lock_guard<mutex> guard(palette.lock);
+            for (uint8_t color : colors) palette.holds[color]--;
+            colors.clear();
+        }
+    };
 
-        if (if_outside){
-            return;
+    // Calls `visit` with the index and name of every extended color not freed, in index order. Takes the lock, so
+    // it may run beside commands that name new colors.
+    template <typename Visit>
+    void for_each_extended(Visit visit){
+        lock_guard<mutex> guard(lock);
+        for (size_t i = NAMED_COUNT; i < count; i++){
+            if (states[i] != Free) visit((uint8_t)i, entries[i].name);
         }
+    }
 
-        for (int i = 0; i < size; i++) {
-            int current_row = y - i;
+    // Retires the live extended slots whose flag in `used` (one per index) is not set and that nothing holds. The
+    // board calls it once it has been cleared or loaded, with the colors of its figures and of its history; the
+    // names are forgotten at once and the slots are handed out again when the last version from before is gone.
+    // Returns whether any slot was retired.
+    bool release(const bool* used){
+        lock_guard<mutex> guard(lock);
+        Retirement retirement = {epoch, {}};
+        for (size_t i = count; i-- > NAMED_COUNT;){
+            if (used[i] || holds[i] != 0 || states[i] != Live) continue;
+            extended.erase(entries[i].name);
+            states[i] = Retired;
+            retirement.slots.push_back(i);
+        }
+        if (retirement.slots.empty()){
+            return false;
+        }
+        retired.push_back(move(retirement));
+        epoch = make_shared<atomic<int>>(0);
+        collect();
+        return true;
+    }
 
-            if (current_row >= 0 && current_row < up_bound) {
-                if (i==0 || i == size-1) {
-                    for (int j = x; j < x + size; j++) {
-                        if (j >= 0 && j < right_bound){
-                            shared_ptr<Cell> cell = (*grid)[up_bound - current_row - 1][j].lock();
+    // Whether a name is spelled like a 256-color or truecolor entry, so a failed resolve() means the palette is full.
+    static bool is_extended(const string_view& name){
+        return !escape(name).empty();
+    }
 
-                            if (!cell) {
-                                cell = make_shared<Cell>(&display_char, display_color);
-                                (*grid)[up_bound - current_row - 1][j] = cell;
-                                occupiedCells.push_back(cell);  
-                            }
-                            cell->addFigure(this);
-                        }
-                    }
-                    continue;
-                }
-            }
+    static size_t extended_capacity(){
+        return CAPACITY - NAMED_COUNT;
+    }
 
-            if (current_row >= 0 && current_row < up_bound){
-                if (x >= 0 && x < right_bound) {
-                    shared_ptr<Cell> cell = (*grid)[up_bound - current_row - 1][x].lock();
+    // Named color drawn with `symbol`, or 0 if none is.
+    static uint8_t by_symbol(const char& symbol){
+        for (uint8_t i = 1; i < NAMED_COUNT; i++){
+            if (NAMED_COLORS[i].symbol == symbol) return i;
+        }
+        return 0;
+    }
 
-                    if (!cell) {
-                        cell = make_shared<Cell>(&display_char, display_color);
-                        (*grid)[up_bound - current_row - 1][x] = cell;
-                        occupiedCells.push_back(cell);
-                    }
-                    cell->addFigure(this);
-                }
+    static bool is_named(const uint8_t& index){
+        return index < NAMED_COUNT;
+    }
 
-                if (x + size - 1 >= 0 && x + size - 1 < right_bound) {
-                    shared_ptr<Cell> cell = (*grid)[up_bound - current_row - 1][x+size-1].lock();
+    const char* code(const uint8_t& index) const {
+        return entries[index].code.c_str();
+    }
 
-                    if (!cell) {
-                        cell = make_shared<Cell>(&display_char, display_color);
-                        (*grid)[up_bound - current_row - 1][x+size-1] = cell;
-                        occupiedCells.push_back(cell);
-                    }
-                    cell->addFigure(this);
-                }
-            }
-        }
-            
-        if (fill) {
-            for (int i = 1; i < size - 1; i++) {
-                int current_row = y - i;
-                if (current_row >= 0 && current_row < up_bound) {
-                    for (int j = x; j < x + size; j++) {
-                        if (j >= 0 && j < right_bound) {
-                            shared_ptr<Cell> cell = (*grid)[up_bound - current_row - 1][j].lock();
-
-                            if (!cell) {
-                                cell = make_shared<Cell>(&display_char, display_color);
-                                (*grid)[up_bound - current_row - 1][j] = cell;
-                                occupiedCells.push_back(cell);
-                            }
-                            cell->addFigure(this);
-                        }
-                    }
-                }
-            }
-        }
+    char symbol(const uint8_t& index) const {
+        return entries[index].symbol;
     }
 
-    const string get_info() override {
-        stringstream info;
-        info << "Square: id(" << s_id << "), size( " << size << " ), coordinates( " << get<0>(coordinates) << "," << get<1>(coordinates)
-         << " ), color( " << display_char << " ), filled( "<< (fill ? "yes" : "no") <<" )\n";
-        cout << info.str();
-        return info.str();
+    const string& name(const uint8_t& index) const {
+        return entries[index].name;
     }
 
-    const bool get_placement() override{
-        return if_outside;
+    // How the text format writes a color: the symbol for named colors, the full name for extended ones.
+    string label(const uint8_t& index) const {
+        return is_named(index) ? string(1, entries[index].symbol) : entries[index].name;
     }
 
-    bool operator==(const Figure& other) const override{
-        const Square* otherFigure = dynamic_cast<const Square*>(&other);
-        if (otherFigure){
-            return size == otherFigure->size && coordinates == otherFigure->coordinates;
-        }
-        return false;
+    size_t size() const {
+        return count;
     }
+};
 
-    char get_symbol() const override{
-        return display_char;
+// Previous contents of a horizontal run of cells inside one tile row. Applying it swaps the run with the board,
+// so the same record serves undo and redo. The saved cells live in the journal's planes starting at `offset`.
+struct SpanChange{
+    size_t index;
+    uint32_t length;
+    size_t offset;
+};
+
+// Cells [first, last] of a row, counted from the top of the board.
+struct RowSpan{
+    int row;
+    int first;
+    int last;
+};
+
+struct Journal{
+    vector<SpanChange> spans;
+    vector<char> glyph;
+    vector<uint8_t> color;
+    vector<int32_t> top;
+
+    bool empty() const { return spans.empty(); }
+
+    size_t bytes() const {
+        return spans.capacity() * sizeof(SpanChange) + glyph.capacity() + color.capacity() + top.capacity() * sizeof(int32_t);
     }
 
-    const char* get_color() const override{
-        return display_color;
+    void clear(){
+        spans.clear();
+        glyph.clear();
+        color.clear();
+        top.clear();
     }
+};
 
-    int get_id()const override{
-        return s_id;
+// Fills a run of figure ids four at a time.
+inline void fill_ids(int32_t* out, const int& count, const int32_t& value){
+#ifdef __SSE2__
+    __m128i ids = _mm_set1_epi32(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4){
+        _mm_storeu_si128((__m128i*)(out + i), ids);
     }
-    
-    string get_type() const override{
-        return "Square";
+    for (; i < count; i++){
+        out[i] = value;
     }
+#else
+    fill_n(out, count, value);
+#endif
+}
 
-    void set_color(pair<char, const char*> new_color) override{
-        display_color = new_color.second;
-        display_char = new_color.first;
-    }
-};
-
-// class Triangle: public Figure{
-// private:
-//     int height;
-//     int s_id;
-//     tuple<int,int> coordinates;
-//     bool if_outside;
-// public:
-//     Triangle(const int& height, const int& x, const int& y): height(height), coordinates(make_tuple(x,y)), s_id(id++) {}
-
-//     void add(vector<vector<char>>* grid) override{
-//         if (height <= 0) return;
-        
-//         int x = get<0>(coordinates); 
-//         int y = get<1>(coordinates); 
-
-//         int up_bound = grid[0].size();
-//         int right_bound = grid[0][0].size();
-
-//         if_outside = y+height > up_bound || y < 0 || x + height/2 < 0 || x-height/2 > right_bound; 
-
-//         if (if_outside){
-//             return;
-//         }
-
-//         for (int i = 0; i < height; ++i) {
-//             int leftMost = x - i;    
-//             int rightMost = x + i;   
-//             int posY = y - i;        
-
-            
-//             if ((posY) >= 0 && (posY) <= up_bound) {
-//                 if (leftMost >= 0 && leftMost < right_bound) {
-//                     (*grid)[up_bound - posY][leftMost] = '*';
-//                 }
-            
-//                 if (rightMost >= 0 && rightMost < right_bound) {
-//                     (*grid)[up_bound - posY][rightMost] = '*';
-//                 }
-//             }
-//         }
-
-    
-//         int baseY = y - height + 1; 
-//         for (int j = 0; j < 2 * height - 1; ++j) {
-//             int baseX = x + height - 1 - j;
-//             if (baseX >= 0 && baseX < right_bound && (baseY) >= 0 && (baseY) <= up_bound) {
-//                 (*grid)[up_bound-baseY][baseX] = '*'; 
-//             }
-//         }
-//     }
-
-//     const string get_info() override {
-//         stringstream info;
-//         info << "Triangle: id(" << s_id << "), height( " << height << " ), coordinates( " << get<0>(coordinates) << "," << get<1>(coordinates) << " )\n";
-//         cout << info.str();
-//         return info.str();
-//     }
-
-//     const bool get_placement() override{
-//         return if_outside;
-//     }
-
-//     bool operator==(const Figure& other) const override{
-//         const Triangle* otherFigure = dynamic_cast<const Triangle*>(&other);
-//         if (otherFigure){
-//             return height == otherFigure->height && coordinates == otherFigure->coordinates;
-//         }
-//         return false;
-//     }
-// };
-
-// class Circle: public Figure{
-// private:
-//     int radius;
-//     int s_id;
-//     tuple<int, int> coordinates;
-//     bool if_outside;
-// public:
-//     Circle(const int& radius, const int& x, const int& y): radius(radius), coordinates(make_tuple(x,y)), s_id(id++) {}
-
-//     void add(vector<vector<char>>* grid) override{
-//         if (radius <= 0){
-//             cerr << "Please, provide positive numbers for size\n";
-//             return;
-//         }
-        
-//         int x = get<0>(coordinates); 
-//         int y = get<1>(coordinates); 
-
-//         int up_bound = grid[0].size();
-//         int right_bound = grid[0][0].size();
-
-//         if_outside = y+radius > up_bound || y-radius < 0 || x + radius < 0 || x - radius  > right_bound; 
-
-//         if (if_outside){
-//             return;
-//         }
-
-//         for (double t = 0.0; t < 6.3; t+=0.1){
-//             int x_draw = (int)(radius * sin(t) + x);
-//             int y_draw = (int)(radius * cos(t) + y);
-            
-//             if(x_draw>0 && x_draw < right_bound && up_bound - y_draw > 0 && y_draw>0){
-//                 (*grid)[up_bound - y_draw][x_draw] = '*';                
-//             }
-//         }
-//     }
-
-//     const string get_info() override {
-//         stringstream info;
-//         info << "Circle: id(" << s_id << "), radius( " << radius << " ), coordinates( " << get<0>(coordinates) << "," << get<1>(coordinates) << " )\n";
-//         cout << info.str();
-//         return info.str();
-//     }
-
-//     const bool get_placement() override{
-//         return if_outside;
-//     }
-
-//     bool operator==(const Figure& other) const override{
-//         const Circle* otherFigure = dynamic_cast<const Circle*>(&other);
-//         if (otherFigure){
-//             return radius == otherFigure->radius && coordinates == otherFigure->coordinates;
-//         }
-//         return false;
-//     }
-// };
-
-// class Line: public Figure{
-// private:
-//     int length;
-//     int angle;
-//     int s_id;
-//     tuple<int, int> coordinates;
-//     bool if_outside;
-// public:
-//     Line(const int& length, const int& angle, const int& x, const int& y): length(length), angle(angle), coordinates(make_tuple(x,y)), s_id(id++) {}
-
-//     void add(vector<vector<char>>* grid) override{
-//         if (length < 0 || angle < 0) {
-//             cerr << "Please, provide positive numbers for size\n";
-//             return;
-//         } 
-
-//         int x = get<0>(coordinates); 
-//         int y = get<1>(coordinates); 
-
-//         int up_bound = grid[0].size();
-//         int right_bound = grid[0][0].size();
-
-//         double rad_angle = angle * 3.14 / 180.0;
-
-//         if_outside = y + (int)(length * sin(rad_angle)) > up_bound || y-(int)(length * sin(rad_angle)) < 0 || x + (int)(length * cos(rad_angle)) < 0 || x > right_bound; 
-
-//         if (if_outside){
-//             return;
-//         }
-
-//         for (int i = 0; i < length; ++i) {
-//             int x_draw = x + (int)(i * cos(rad_angle));
-//             int y_draw = y + (int)(i * sin(rad_angle));
-
-//             if (x_draw > 0 && x_draw < right_bound && up_bound - y_draw > 0 && y_draw > 0) {
-//                 (*grid)[up_bound - y_draw][x_draw] = '*';
-//             }
-//         }
-//     }
-
-//     const string get_info() override {
-//         stringstream info;
-//         info << "Line: id(" << s_id << "), length( " << length << " ), angle( " << angle << " ), coordinates( " << get<0>(coordinates) << "," << get<1>(coordinates) << " )\n";
-//         cout << info.str();
-//         return info.str();
-//     }
-
-//     const bool get_placement() override{
-//         return if_outside;
-//     }
-
-//     bool operator==(const Figure& other) const override{
-//         const Line* otherFigure = dynamic_cast<const Line*>(&other);
-//         if (otherFigure){
-//             return angle == otherFigure->angle && length == otherFigure->length && coordinates == otherFigure->coordinates;
-//         }
-//         return false;
-//     }
-// };
+const int TILE_SHIFT = 4;
+const int TILE_SIZE = 1 << TILE_SHIFT;
+const int TILE_CELLS = TILE_SIZE * TILE_SIZE;
+
+// TILE_SIZE x TILE_SIZE block of the board planes: glyph, color index and id of the topmost figure for every cell.
+// `key` and `epoch` tell whether the arena slot still belongs to the map entry that points at it.
+struct Tile{
+    char glyph[TILE_CELLS];
+    uint8_t color[TILE_CELLS];
+    int32_t top[TILE_CELLS];
+    bool dirty = false;
+    // Written since the framebuffer was last frozen.
+    bool thawed = false;
+    uint64_t key = UINT64_MAX;
+    uint32_t epoch = 0;
+
+    void reset(const uint64_t& owner, const uint32_t& current){
+        memset(glyph, ' ', sizeof(glyph));
+        memset(color, 0, sizeof(color));
+        fill(top, top + TILE_CELLS, -1);
+        dirty = false;
+        thawed = false;
+        key = owner;
+        epoch = current;
+    }
 
-class Blackboard
-{
+    // Nothing drawn in it, as after its figures were erased; such tiles are left out of snapshot files.
+    bool blank() const {
+        return all_of(top, top + TILE_CELLS, [](const int32_t& id){ return id == -1; });
+    }
+};
+
+// Tiles handed out in order from fixed-size chunks. A clear only rewinds the cursor, so it is O(1) and the next
+// drawing reuses the same memory without allocator calls; chunks go back to the heap together with the arena.
+class TileArena{
 private:
-    const int BOARD_WIDTH = 90;
-    const int BOARD_HEIGHT = 50;
-
-    map<string, pair<char, const char*>> ALLOWED_COLORS = {
-        {"red", {'r', RED}},
-        {"green", {'g', GREEN}},
-        {"blue", {'b', BLUE}},
-        {"yellow", {'y', YELLOW}},
-        {"black", {'k', BLACK}},
-        {"white", {'w', WHITE}},
-        {"cyan", {'c', CYAN}},
-        {"magenta", {'m', MAGENTA}},
-        {"purple", {'p', PURPLE}}
-    };
-    Figure* selected_figure;
-    vector<vector<weak_ptr<Cell>>> grid;;
-    vector<unique_ptr<Figure>> figures;
-    vector<vector<weak_ptr<Cell>>> previous;
-public:
-    Blackboard() : grid(BOARD_HEIGHT, vector<weak_ptr<Cell>>(BOARD_WIDTH)), 
-                    previous(BOARD_HEIGHT, vector<weak_ptr<Cell>>(BOARD_WIDTH)) {}
+    static const size_t CHUNK_TILES = 64;
 
+    vector<unique_ptr<Tile[]>> chunks;
+    size_t used = 0;
 
-    void draw() {
-        cout << " ";
-        for (int j = 0; j<= BOARD_WIDTH; j++){
-            cout << RED << "-" << RESET; 
+public:
+    Tile* allocate(const uint64_t& key, const uint32_t& epoch){
+        if (used == chunks.size() * CHUNK_TILES){
+            chunks.emplace_back(new Tile[CHUNK_TILES]);
         }
-        cout << "\n";
-        for (auto& row : grid) {
-            cout << RED << '|' << RESET;
-            for (auto& c : row) {
+        Tile* tile = &chunks[used / CHUNK_TILES][used % CHUNK_TILES];
+        used++;
+        tile->reset(key, epoch);
+        return tile;
+    }
 
-                shared_ptr<Cell> cell = c.lock();
+    Tile& operator[](const size_t& i) const { return chunks[i / CHUNK_TILES][i % CHUNK_TILES]; }
 
-                if (cell!=nullptr){
-                    cout << cell->get_color() << cell->get_symbol(); 
-                }
+    size_t size() const { return used; }
+    size_t capacity() const { return chunks.size() * CHUNK_TILES; }
+
+    void reset(){
+        used = 0;
+    }
+};
+
+// Read-only copy of the raster: a trie over tile keys with 64 children per node, holding only the occupied parts
+// of the board. Nodes and tiles are shared between copies until they change, so a copy is one pointer, cheap to
+// keep and safe to read from any thread while the live framebuffer moves on.
+class FrozenRaster{
+private:
+    static const int FANOUT_SHIFT = 6;
+
+    // Children in slot order, with a bit in `present` for every slot in use. Nodes on the last level hold tiles.
+    struct Node{
+        uint64_t present = 0;
+        vector<shared_ptr<const Node>> children;
+        vector<shared_ptr<const Tile>> tiles;
+
+        bool has(const int& slot) const { return present >> slot & 1; }
+        int index(const int& slot) const { return __builtin_popcountll(present & ((1ULL << slot) - 1)); }
+    };
+
+    shared_ptr<const Node> root;
+    // Keys are packed as tile_row << col_bits | tile_col and split into `depth` levels of FANOUT_SHIFT bits.
+    uint32_t tile_cols = 0;
+    uint32_t tile_rows = 0;
+    int col_bits = 0;
+    int depth = 1;
+    size_t count = 0;
+
+    friend class Framebuffer;
+
+    static int bits_for(const uint32_t& values) { return values > 1 ? 32 - __builtin_clz(values - 1) : 0; }
+
+    uint64_t packed(const uint64_t& tile_col, const uint64_t& tile_row) const { return tile_row << col_bits | tile_col; }
+    int slot(const uint64_t& key, const int& level) const { return key >> (depth - 1 - level) * FANOUT_SHIFT & 63; }
+
+    // Copy of `node` (nullptr for a new one) with the tiles of the sorted range [first, last) stored in it.
+    shared_ptr<const Node> update(const Node* node, const int& level, const pair<uint64_t, const Tile*>* first,
+                                  const pair<uint64_t, const Tile*>* last){
+        auto copy = node != nullptr ? make_shared<Node>(*node) : make_shared<Node>();
+        while (first != last){
+            int at = slot(first->first, level);
+            auto end = first;
+            while (end != last && slot(end->first, level) == at) end++;
+            int i = copy->index(at);
+            bool had = copy->has(at);
+            if (level == depth - 1){
+                auto tile = make_shared<const Tile>(*first->second);
+                if (had) copy->tiles[i] = move(tile);
                 else{
-                    cout << " ";
+                    copy->tiles.insert(copy->tiles.begin() + i, move(tile));
+                    count++;
                 }
             }
-            cout  << RED << " |\n" << RESET;
+            else{
+                auto child = update(had ? copy->children[i].get() : nullptr, level + 1, first, end);
+                if (had) copy->children[i] = move(child);
+                else copy->children.insert(copy->children.begin() + i, move(child));
+            }
+            copy->present |= 1ULL << at;
+            first = end;
         }
-        cout << " ";
-        for (int j = 0; j<= BOARD_WIDTH; j++){
-            cout << RED << "-" << RESET; 
+        return copy;
+    }
+
+    template <typename Visit>
+    void walk(const Node& node, const int& level, const uint64_t& prefix, Visit& visit) const {
+        int i = 0;
+        for (uint64_t bits = node.present; bits != 0; bits &= bits - 1, i++){
+            uint64_t key = prefix << FANOUT_SHIFT | __builtin_ctzll(bits);
+            if (level == depth - 1) visit(key, *node.tiles[i]);
+            else walk(*node.children[i], level + 1, key, visit);
         }
-        cout << '\n';
     }
+public:
+    FrozenRaster() = default;
 
-    void add_square(string fill, const string& color, const int& size, const int& x, const int& y){
-        previous = grid;
-        bool flag;
+    FrozenRaster(const int& width, const int& height) : tile_cols((width + TILE_SIZE - 1) >> TILE_SHIFT),
+        tile_rows((height + TILE_SIZE - 1) >> TILE_SHIFT), col_bits(bits_for(tile_cols)) {
+        depth = max(1, (col_bits + bits_for(tile_rows) + FANOUT_SHIFT - 1) / FANOUT_SHIFT);
+    }
 
-        if (fill == "fill"){
-            flag = true;
+    const Tile* tile_at(const int& col, const int& row) const {
+        uint32_t tile_col = col >> TILE_SHIFT, tile_row = row >> TILE_SHIFT;
+        if (tile_col >= tile_cols || tile_row >= tile_rows) return nullptr;
+        uint64_t key = packed(tile_col, tile_row);
+        const Node* node = root.get();
+        for (int level = 0; node != nullptr; level++){
+            int at = slot(key, level);
+            if (!node->has(at)) return nullptr;
+            if (level == depth - 1) return node->tiles[node->index(at)].get();
+            node = node->children[node->index(at)].get();
         }
-        else flag = false;
+        return nullptr;
+    }
 
-        auto new_figure = make_unique<Square>(flag,ALLOWED_COLORS[color],size, x, y);
+    size_t tile_count() const { return count; }
+
+    // Same tile section as Framebuffer::write_tiles; the trie is walked in key order, which is row-major.
+    void write_tiles(ostream& out) const {
+        uint32_t written = 0;
+        auto counted = [&](const uint64_t&, const Tile& tile){ written += !tile.blank(); };
+        if (root) walk(*root, 0, 0, counted);
+        out.write((const char*)&written, sizeof(written));
+        if (!root) return;
+        uint64_t col_mask = (1ULL << col_bits) - 1;
+        auto write = [&](const uint64_t& key, const Tile& tile){
+            if (tile.blank()) return;
+            int32_t position[2] = {(int32_t)(key & col_mask), (int32_t)(key >> col_bits)};
+            out.write((const char*)position, sizeof(position));
+            out.write(tile.glyph, sizeof(Tile::glyph));
+            out.write((const char*)tile.color, sizeof(Tile::color));
+            out.write((const char*)tile.top, sizeof(Tile::top));
+        };
+        walk(*root, 0, 0, write);
+    }
+};
 
-        for (const auto& figure : figures) {
-            Square* existing_square = dynamic_cast<Square*>(figure.get());
-            if (existing_square && *existing_square == *new_figure) {
-                cout << "Same figure exists\n";
-                return;
-            }
+// Sparse board planes: tiles are allocated the first time a figure writes into them, so memory follows the occupied area.
+// Rows are counted from the top of the board; cell indexes in journals are row * width + col.
+class Framebuffer{
+private:
+    int width;
+    int height;
+    // Index into the arena. Entries left over from before a clear point at slots that were since reused or
+    // rewound; live() tells them apart, and they are dropped in bulk once they outnumber the arena.
+    unordered_map<uint64_t, Tile*> tiles;
+    TileArena arena;
+    uint32_t epoch = 1;
+    mutable uint64_t cached_key = UINT64_MAX;
+    mutable Tile* cached = nullptr;
+    Journal* journal = nullptr;
+    // Cells written by put, fill_span and clear_span since construction.
+    uint64_t written = 0;
+    // Writes outside this window (inclusive, in rows from the top) are dropped; see set_clip.
+    int clip_col0 = 0, clip_row0 = 0, clip_col1 = INT_MAX, clip_row1 = INT_MAX;
+    // See set_collect and set_mask.
+    vector<RowSpan>* collect = nullptr;
+    const vector<RowSpan>* mask = nullptr;
+    // Tiles written since the last live update; damaged_all after a clear or a bulk load.
+    vector<uint64_t> damaged;
+    bool damaged_all = true;
+    // Copy handed out by freeze(), and the tiles written since; a clear starts the copy over. `frozen_scratch`
+    // keeps its capacity between calls.
+    FrozenRaster frozen;
+    vector<uint64_t> thawed;
+    vector<pair<uint64_t, const Tile*>> frozen_scratch;
+    bool frozen_reset = true;
+
+    static uint64_t tile_key(const int& tx, const int& ty) { return (uint64_t)(uint32_t)ty << 32 | (uint32_t)tx; }
+
+    bool live(const Tile* tile, const uint64_t& key) const { return tile->epoch == epoch && tile->key == key; }
+
+    void thaw(Tile* tile){
+        if (!tile->thawed){
+            tile->thawed = true;
+            thawed.push_back(tile->key);
         }
-        new_figure->add(&grid);
+    }
 
-        if (new_figure.get()->get_placement()){
-            cout << "Figure is outside the box\n";
-            return;
+    // Arena slot for a tile whose planes are about to be overwritten whole.
+    Tile* adopt(const uint64_t& key){
+        auto found = tiles.find(key);
+        Tile* tile;
+        if (found != tiles.end() && live(found->second, key)){
+            tile = found->second;
         }
+        else tile = tiles[key] = arena.allocate(key, epoch);
+        thaw(tile);
+        return tile;
+    }
 
-        figures.push_back(move(new_figure));
-    } 
-
-    // void add_triangle(const int& height, const int& x, const int& y){
-    //     previous = grid;
+    Tile* find(const int& col, const int& row) const {
+        uint64_t key = tile_key(col >> TILE_SHIFT, row >> TILE_SHIFT);
+        if (key != cached_key){
+            auto found = tiles.find(key);
+            if (found == tiles.end() || !live(found->second, key)) return nullptr;
+            cached_key = key;
+            cached = found->second;
+        }
+        return cached;
+    }
 
-    //     auto new_figure = make_unique<Triangle>(height, x, y);
+    Tile& touch(const int& col, const int& row){
+        Tile* found = find(col, row);
+        if (found == nullptr){
+            uint64_t key = tile_key(col >> TILE_SHIFT, row >> TILE_SHIFT);
+            found = tiles[key] = arena.allocate(key, epoch);
+            cached_key = key;
+            cached = found;
+        }
+        if (!found->dirty){
+            found->dirty = true;
+            damaged.push_back(cached_key);
+        }
+        thaw(found);
+        return *found;
+    }
 
-    //     for (const auto& figure : figures) {
-    //         Triangle* existing_triangle = dynamic_cast<Triangle*>(figure.get());
-    //         if (existing_triangle && *existing_triangle == *new_figure) {
-    //             cout << "Same figure exists\n";
-    //             return;
-    //         }
-    //     }
-    //     new_figure->add(&grid);
+    static int offset(const int& col, const int& row) { return (row & (TILE_SIZE - 1)) << TILE_SHIFT | (col & (TILE_SIZE - 1)); }
 
-    //     if (new_figure.get()->get_placement()){
-    //         cout << "Figure is outside the box\n";
-    //         return;
-    //     }
+    // Calls visit for every part of cells [first, last] of a row that lies inside the mask.
+    template <typename Visit>
+    void masked(const int& row, const int& first, const int& last, Visit visit) const {
+        auto span = lower_bound(mask->begin(), mask->end(), make_pair(row, first), [](const RowSpan& span, const pair<int, int>& cell){
+            return span.row < cell.first || (span.row == cell.first && span.last < cell.second);
+        });
+        for (; span != mask->end() && span->row == row && span->first <= last; ++span){
+            visit(max(first, span->first), min(last, span->last));
+        }
+    }
 
-    //     figures.push_back(move(new_figure));  
-    // } 
+    void write_span(const int& row, const int& first_col, const int& last_col, char symbol, uint8_t color_id, int figure_id){
+        for (int col = first_col; col <= last_col;){
+            int length = min(last_col + 1, ((col >> TILE_SHIFT) + 1) << TILE_SHIFT) - col;
+            Tile& tile = touch(col, row);
+            int i = offset(col, row);
+            written += length;
+            if (journal != nullptr){
+                record(tile, col, row, length);
+            }
+            memset(tile.glyph + i, symbol, length);
+            memset(tile.color + i, color_id, length);
+            fill_ids(tile.top + i, length, figure_id);
+            col += length;
+        }
+    }
+public:
+    Framebuffer(const int& width, const int& height) : width(width), height(height) {}
 
-    // void add_circle(const int& radius, const int& x, const int& y){
-    //     previous = grid;
+    int get_width() const { return width; }
+    int get_height() const { return height; }
 
-    //     auto new_figure = make_unique<Circle>(radius, x, y);
+    void record(const Tile& tile, const int& col, const int& row, const int& length){
+        int i = offset(col, row);
+        journal->spans.push_back({(size_t)row * width + col, (uint32_t)length, journal->top.size()});
+        journal->glyph.insert(journal->glyph.end(), tile.glyph + i, tile.glyph + i + length);
+        journal->color.insert(journal->color.end(), tile.color + i, tile.color + i + length);
+        journal->top.insert(journal->top.end(), tile.top + i, tile.top + i + length);
+    }
 
-    //     for (const auto& figure : figures) {
-    //         Circle* existing_circle = dynamic_cast<Circle*>(figure.get());
-    //         if (existing_circle && *existing_circle == *new_figure) {
-    //             cout << "Same figure exists\n";
-    //             return;
-    //         }
-    //     }
-    //     new_figure->add(&grid);
+    // Records the cells of sorted, non-overlapping spans as if they were about to be overwritten.
+    void save_spans(const vector<RowSpan>& spans){
+        for (auto& span : spans){
+            for (int col = span.first; col <= span.last;){
+                int length = min(span.last + 1, ((col >> TILE_SHIFT) + 1) << TILE_SHIFT) - col;
+                record(touch(col, span.row), col, span.row, length);
+                col += length;
+            }
+        }
+    }
 
-    //     if (new_figure.get()->get_placement()){
-    //         cout << "Figure is outside the box\n";
-    //         return;
-    //     }
+    void put(const int& col, const int& row, char symbol, uint8_t color_id, int figure_id){
+        if (col < clip_col0 || col > clip_col1 || row < clip_row0 || row > clip_row1){
+            return;
+        }
+        if (collect != nullptr){
+            collect->push_back({row, col, col});
+            return;
+        }
+        if (mask != nullptr){
+            bool inside = false;
+            masked(row, col, col, [&](const int&, const int&){ inside = true; });
+            if (!inside) return;
+        }
+        Tile& tile = touch(col, row);
+        int i = offset(col, row);
+        written++;
+        if (journal != nullptr){
+            record(tile, col, row, 1);
+        }
+        tile.glyph[i] = symbol;
+        tile.color[i] = color_id;
+        tile.top[i] = figure_id;
+    }
 
-    //     figures.push_back(move(new_figure));       
-    // }
+    // Writes cells [first_col, last_col] of a row, one tile segment at a time with block fills.
+    void fill_span(const int& row, const int& first_col, const int& last_col, char symbol, uint8_t color_id, int figure_id){
+        if (row < clip_row0 || row > clip_row1){
+            return;
+        }
+        int first = max(first_col, clip_col0);
+        int last = min(last_col, clip_col1);
+        if (first > last){
+            return;
+        }
+        if (collect != nullptr){
+            collect->push_back({row, first, last});
+        }
+        else if (mask != nullptr){
+            masked(row, first, last, [&](const int& from, const int& to){ write_span(row, from, to, symbol, color_id, figure_id); });
+        }
+        else write_span(row, first, last, symbol, color_id, figure_id);
+    }
 
-    // void add_line(const int& length, const int& angle, const int& x, const int& y){
-    //     previous = grid;
+    // Resets cells [first_col, last_col] of a row to blank; tiles that were never drawn are skipped, not allocated.
+    void clear_span(const int& row, const int& first_col, const int& last_col){
+        for (int col = first_col; col <= last_col;){
+            int length = min(last_col + 1, ((col >> TILE_SHIFT) + 1) << TILE_SHIFT) - col;
+            if (find(col, row) != nullptr){
+                Tile& tile = touch(col, row);
+                int i = offset(col, row);
+                written += length;
+                if (journal != nullptr){
+                    record(tile, col, row, length);
+                }
+                memset(tile.glyph + i, ' ', length);
+                memset(tile.color + i, 0, length);
+                fill_ids(tile.top + i, length, -1);
+            }
+            col += length;
+        }
+    }
 
-    //     auto new_figure = make_unique<Line>(length, angle, x, y);
+    // Limits put and fill_span to a window, so a figure can be redrawn into part of the board only.
+    void set_clip(const int& first_col, const int& first_row, const int& last_col, const int& last_row){
+        clip_col0 = first_col;
+        clip_row0 = first_row;
+        clip_col1 = last_col;
+        clip_row1 = last_row;
+    }
 
-    //     for (const auto& figure : figures) {
-    //         Line* existing_line = dynamic_cast<Line*>(figure.get());
-    //         if (existing_line && *existing_line == *new_figure) {
-    //             cout << "Same figure exists\n";
-    //             return;
-    //         }
-    //     }
-    //     new_figure->add(&grid);
+    void reset_clip(){
+        set_clip(0, 0, INT_MAX, INT_MAX);
+    }
 
-    //     if (new_figure.get()->get_placement()){
-    //         cout << "Figure is outside the box\n";
-    //         return;
-    //     }
+    // While set, put and fill_span write nothing and append the spans they would have written instead, which
+    // gives the footprint of a figure.
+    void set_collect(vector<RowSpan>* spans){
+        collect = spans;
+    }
 
-    //     figures.push_back(move(new_figure));     
-    // }
+    // While set, put and fill_span write only inside these spans, which are sorted by row and column and do not
+    // overlap.
+    void set_mask(const vector<RowSpan>* spans){
+        mask = spans;
+    }
 
-    void shapes() {
-        cout << MAGENTA << "Square:" << YELLOW << " size, coordinates" << BLUE << "[x,y]" << RESET << " of top left edge\n";
-        cout << MAGENTA << "Circle:" << YELLOW << " radius, coordinates" << BLUE << "[x,y]" << RESET << " of centre\n";
-        cout << MAGENTA << "Triangle:" << YELLOW << " height, coordinates" << BLUE << "[x,y]" << RESET << " of upmost edge\n";
-        cout << MAGENTA << "Line:" << YELLOW << " length, angle, coordinates" << BLUE << "[x,y]" << RESET << " of left edge\n";
-    };
+    // Clip window intersected with the board.
+    void clip_window(int& first_col, int& first_row, int& last_col, int& last_row) const {
+        first_col = clip_col0;
+        first_row = clip_row0;
+        last_col = min(clip_col1, width - 1);
+        last_row = min(clip_row1, height - 1);
+    }
 
-    const vector<string> list(){
-        vector<string> figures_info;
-        if(figures.size() > 0){
-            for (auto& shape: figures){
-                figures_info.push_back(shape->get_info());
-            }
+    // Copies in the tiles of a framebuffer that drew a disjoint part of the same board.
+    void absorb(Framebuffer& other){
+        for (size_t i = 0; i < other.arena.size(); i++){
+            const Tile& source = other.arena[i];
+            Tile* tile = adopt(source.key);
+            memcpy(tile->glyph, source.glyph, sizeof(Tile::glyph));
+            memcpy(tile->color, source.color, sizeof(Tile::color));
+            memcpy(tile->top, source.top, sizeof(Tile::top));
         }
-        else cout << " No figures on board\n";
+        written += other.written;
+        other.clear();
+        damaged_all = true;
+        cached_key = UINT64_MAX;
+        cached = nullptr;
+    }
 
-        return figures_info;        
+    // Tile holding the cell, or nullptr if nothing was ever drawn there.
+    const Tile* tile_at(const int& col, const int& row) const { return find(col, row); }
+
+    char glyph_at(const int& col, const int& row) const {
+        const Tile* tile = find(col, row);
+        return tile ? tile->glyph[offset(col, row)] : ' ';
+    }
+    uint8_t color_at(const int& col, const int& row) const {
+        const Tile* tile = find(col, row);
+        return tile ? tile->color[offset(col, row)] : 0;
+    }
+    int top_at(const int& col, const int& row) const {
+        const Tile* tile = find(col, row);
+        return tile ? tile->top[offset(col, row)] : -1;
     }
 
-    void undo(){
-        if(figures.size() > 0){
-            figures.pop_back();
-            grid = previous;
-        }
-        else cout << "No figures on board\n";
+    static int cell_offset(const int& col, const int& row) { return offset(col, row); }
+
+    void set_journal(Journal* spans){
+        journal = spans;
     }
 
-    void clear(){
-        figures.clear();
+    void swap(Journal& saved, const SpanChange& change){
+        int col = change.index % width;
+        int row = change.index / width;
+        Tile& tile = touch(col, row);
+        int i = offset(col, row);
+        swap_ranges(tile.glyph + i, tile.glyph + i + change.length, saved.glyph.begin() + change.offset);
+        swap_ranges(tile.color + i, tile.color + i + change.length, saved.color.begin() + change.offset);
+        swap_ranges(tile.top + i, tile.top + i + change.length, saved.top.begin() + change.offset);
     }
 
-    void select_figure_by_coord(const int& x, const int& y){
-        shared_ptr<Cell> cell = grid[BOARD_HEIGHT-y][x].lock(); 
+    bool is_damaged_all() const { return damaged_all; }
+    const vector<uint64_t>& damaged_tiles() const { return damaged; }
 
-        if (cell!=nullptr){
-            selected_figure = cell->lastFigure();
-            cout << "Selected ";
-            selected_figure->get_info();
+    void clear_damage(){
+        for (uint64_t key : damaged){
+            auto found = tiles.find(key);
+            if (found != tiles.end() && live(found->second, key)) found->second->dirty = false;
         }
-        else{
-            cout << "There is no figure on coordinates\n";
+        damaged.clear();
+        damaged_all = false;
+    }
+
+    size_t tile_count() const { return arena.size(); }
+    uint64_t cells_written() const { return written; }
+    size_t bytes() const { return arena.capacity() * sizeof(Tile) + tiles.size() * (sizeof(uint64_t) + 3 * sizeof(void*)); }
+
+    // Tile section of a binary snapshot: count, then tile x, tile y and the three planes of every tile that is
+    // not blank. Tiles are written in row-major tile order, so equal boards give equal files however the map was
+    // filled and whatever was erased from it.
+    void write_tiles(ostream& out) const {
+        vector<const Tile*> sorted;
+        for (size_t i = 0; i < arena.size(); i++){
+            if (!arena[i].blank()) sorted.push_back(&arena[i]);
+        }
+        uint32_t count = sorted.size();
+        out.write((const char*)&count, sizeof(count));
+        sort(sorted.begin(), sorted.end(), [](const Tile* a, const Tile* b){ return a->key < b->key; });
+        for (const Tile* entry : sorted){
+            const Tile& tile = *entry;
+            int32_t position[2] = {(int32_t)(uint32_t)tile.key, (int32_t)(tile.key >> 32)};
+            out.write((const char*)position, sizeof(position));
+            out.write(tile.glyph, sizeof(Tile::glyph));
+            out.write((const char*)tile.color, sizeof(Tile::color));
+            out.write((const char*)tile.top, sizeof(Tile::top));
         }
     }
 
-    void select_by_id(const int& id){
-        if(figures.size() > 0){
-            for (auto& shape: figures){
-                if (id == shape->get_id()){
-                    selected_figure = shape.get();
-                    cout << "Selected: ";
-                    shape->get_info();
-                }
-            }
+    static size_t tile_record_size() { return 2 * sizeof(int32_t) + sizeof(Tile::glyph) + sizeof(Tile::color) + sizeof(Tile::top); }
+
+    void load_tiles(const char* data, const uint32_t& count){
+        clear();
+        for (uint32_t i = 0; i < count; i++, data += tile_record_size()){
+            int32_t position[2];
+            memcpy(position, data, sizeof(position));
+            // Tiles off the board can never be drawn; a damaged file is not allowed to place them.
+            if (position[0] < 0 || position[1] < 0 || position[0] > (width - 1) >> TILE_SHIFT || position[1] > (height - 1) >> TILE_SHIFT) continue;
+            Tile* tile = adopt(tile_key(position[0], position[1]));
+            const char* planes = data + sizeof(position);
+            memcpy(tile->glyph, planes, sizeof(Tile::glyph));
+            memcpy(tile->color, planes + sizeof(Tile::glyph), sizeof(Tile::color));
+            memcpy(tile->top, planes + sizeof(Tile::glyph) + sizeof(Tile::color), sizeof(Tile::top));
         }
-        else cout << "No figures with that id\n";
     }
 
-    void remove(){
-        if(figures.size() > 0){
-            for(int i = 0; i < figures.size(); i++){
-                if (selected_figure->get_id() == figures[i]->get_id()){
-                    selected_figure->get_info();
-                    figures.erase(figures.begin() + i);                  
-                    cout << "Was removed\n";
-                }
-            }
+    bool has_thawed() const { return frozen_reset || !thawed.empty(); }
+
+    // Brings the frozen copy up to date and returns it. Only tiles written since the last call are copied, each
+    // together with the trie nodes above it; everything else stays shared with copies handed out before.
+    const FrozenRaster& freeze(){
+        if (frozen_reset){
+            frozen = FrozenRaster(width, height);
+            frozen_reset = false;
+        }
+
+        frozen_scratch.clear();
+        for (uint64_t key : thawed){
+            auto found = tiles.find(key);
+            if (found == tiles.end() || !live(found->second, key)) continue;
+            found->second->thawed = false;
+            frozen_scratch.push_back({frozen.packed((uint32_t)key, key >> 32), found->second});
+        }
+        thawed.clear();
+        if (!frozen_scratch.empty()){
+            sort(frozen_scratch.begin(), frozen_scratch.end());
+            frozen.root = frozen.update(frozen.root.get(), 0, frozen_scratch.data(), frozen_scratch.data() + frozen_scratch.size());
         }
+        return frozen;
     }
 
-    void edit(const int& size){
-        if (auto selected_square = dynamic_cast<Square*>(selected_figure)) {
-            auto new_square = make_unique<Square>(move(*selected_square), size);
-            
-            new_square->add(&grid);
+    // O(1): the arena is rewound and a new epoch makes every tile it handed out stale.
+    void clear(){
+        arena.reset();
+        epoch++;
+        thawed.clear();
+        frozen_reset = true;
+        if (tiles.size() > 4 * arena.capacity() + 1024){
+            tiles.clear();
+        }
+        damaged.clear();
+        damaged_all = true;
+        cached_key = UINT64_MAX;
+        cached = nullptr;
+    }
+};
 
-            if (new_square.get()->get_placement()){
-                cout << "Figure is outside the box\n";
-                new_square.release();
-                return;
-            }
-            figures.push_back(move(new_square));
+// Inclusive rectangle in board coordinates (x to the right, y up).
+struct Rect{
+    int x0, y0, x1, y1;
 
-            if(figures.size() > 0){
-                for(int i = 0; i < figures.size(); i++){
-                    if (selected_figure->get_id() == figures[i]->get_id()){
-                        figures.erase(figures.begin() + i);
-                    }
-                }
-            }
+    bool empty() const { return x0 > x1 || y0 > y1; }
 
-        } else {
-        cout << "Selected figure is not a square.\n"; }
+    Rect intersect(const Rect& other) const {
+        return {max(x0, other.x0), max(y0, other.y0), min(x1, other.x1), min(y1, other.y1)};
     }
 
-    void paint(const string& new_color){
-        selected_figure->set_color(ALLOWED_COLORS[new_color]);
+    // Smallest rectangle holding both.
+    Rect merge(const Rect& other) const {
+        return {min(x0, other.x0), min(y0, other.y0), max(x1, other.x1), max(y1, other.y1)};
     }
 };
 
-class FileSystem {
-private:
-    string path;
-    vector<vector<char>> grid;
-    Blackboard* blackboard;
-public:
-    FileSystem(const string& path, Blackboard* blackboard): path(path), blackboard(blackboard){}
+enum ShapeKind : int { SHAPE_SQUARE, SHAPE_TRIANGLE, SHAPE_CIRCLE, SHAPE_LINE };
 
-    void save(){
-        ofstream file;
-        file.open(path);
-        vector<string> figure_list = blackboard->list();
+// Figures are only built from sizes and coordinates within these, so bounds() and the rasterizers stay inside int.
+const int MAX_FIGURE_SIZE = 1 << 29;
+const int MAX_COORDINATE = 1 << 29;
 
-        if (figure_list.size() != 0){
-            for (auto figure : figure_list){
-                file << figure;
-            }
-        }
-        else file << 0;
+inline bool valid_size(const int& size){
+    return size > 0 && size <= MAX_FIGURE_SIZE;
+}
 
-        cout << "File has been successfully saved!\n";
-        file.close();
-    }
+inline bool valid_coordinate(const int& value){
+    return value >= -MAX_COORDINATE && value <= MAX_COORDINATE;
+}
 
-    void load(){
-        string line;
-        ifstream file (path);
+// Boards stay within the coordinates figures can reach, which also keeps their tile math inside int.
+inline bool valid_board(const int& width, const int& height){
+    return width > 0 && height > 0 && valid_coordinate(width) && valid_coordinate(height);
+}
 
-        blackboard->clear();
+// Size and position of stored figure parameters: a line keeps its angle between them.
+inline bool valid_params(const int& kind, const int32_t* params){
+    const int32_t* position = params + (kind == SHAPE_LINE ? 2 : 1);
+    return valid_size(params[0]) && valid_coordinate(position[0]) && valid_coordinate(position[1]);
+}
 
-        if (file.is_open()){
-            while (getline(file, line)) {
-                if(line[0] == '0'){
-                    return;
-                }
-                else{
+// Exact geometry of a figure: shape kind plus its defining parameters. Color and fill are not part of it.
+struct GeometryKey{
+    int kind;
+    int params[4];
 
-                    string figure;
-                    string label, first_param, second_param;
-                    string id;
-                    char paren_close, comma;
-                    int third_param, x, y;
-
-                    stringstream ss(line);
-                    ss >> figure;
-                    figure.pop_back();
-                    ss >> id;
-                    
-                    if (figure == "Square"){
-                        ss >> label >> first_param >> paren_close >> comma;
-                        ss >> label >> second_param >> paren_close >> comma;
-                        ss >> label >> third_param >> paren_close >> comma;
-                        ss >> label >> x >> comma >> y >> paren_close;
-                        cout << first_param << "|" << x << "|" << y << endl; 
-                        blackboard->add_square(first_param, second_param, third_param, x, y);
-                    }
-                    // else if (figure == "Circle"){
-                    //     ss >> label >> first_param >> paren_close >> comma;
-                    //     ss >> label >> x >> comma >> y >> paren_close;
-                    //     blackboard->add_circle(first_param, x, y);
-                    // }
-                    // else if (figure == "Triangle"){
-                    //     ss >> label >> first_param >> paren_close >> comma;
-                    //     ss >> label >> x >> comma >> y >> paren_close;
-                    //     blackboard->add_triangle(first_param, x, y);
-                    // }
-                    // else if (figure == "Line"){
-                    //     ss >> label >> first_param >> paren_close >> comma;
-                    //     ss >> label >> second_param >> paren_close >> comma;
-                    //     ss >> label >> x >> comma >> y >> paren_close;
-                    //     blackboard->add_line(first_param, second_param, x, y);
-                    // }
-                    else {
-                        cout << "File structure damaged\n";
-                        file.close();
-                        return;
-                    }
-                }
-            }
+    bool operator==(const GeometryKey& other) const {
+        return kind == other.kind && equal(params, params + 4, other.params);
+    }
+};
+
+struct GeometryHash{
+    size_t operator()(const GeometryKey& key) const {
+        size_t hash = key.kind;
+        for (int param : key.params){
+            hash = hash * 1000003 ^ (uint32_t)param;
         }
-        else cout << "Unable to open file\n"; 
-        file.close();
+        return hash;
     }
 };
 
-class Parser {
+// Storage for figures: free lists per 16-byte size class, refilled from 64 KB blocks. Creating and dropping figures,
+// which undo, redo and every load do in bulk, then costs a list push or pop instead of a heap call, and figures end
+// up packed together. Like the tile arena, the pool can be rewound as a whole when a board is cleared; blocks are
+// returned when the program exits.
+class FigurePool{
 private:
-    Blackboard* blackboard;
-    vector<string> split(string& str, const string& delimiter) {
-        vector<std::string> tokens;
-        size_t pos = 0;
-        string token;
-        while ((pos = str.find(delimiter)) != string::npos) {
-            token = str.substr(0, pos);
-            tokens.push_back(token);
-            str.erase(0, pos + delimiter.length());
+    static const size_t BLOCK = 64 << 10;
+    static const size_t GRAIN = 16;
+    static const size_t CLASSES = 16;
+
+    struct Free{
+        Free* next;
+    };
+
+    Free* lists[CLASSES] = {};
+    vector<unique_ptr<char[]>> blocks;
+    // Blocks handed out so far; the last of them has `left` bytes to give.
+    size_t used = 0;
+    size_t left = 0;
+    // Pooled allocations not yet released.
+    size_t live = 0;
+    mutex lock;
+
+public:
+    static FigurePool& instance(){
+        static FigurePool pool;
+        return pool;
+    }
+
+    void* allocate(const size_t& size){
+        size_t grains = (size + GRAIN - 1) / GRAIN;
+        if (grains > CLASSES) return ::operator new(size);
+
+        lock_guard<mutex> guard(lock);
+        live++;
+        Free*& list = lists[grains - 1];
+        if (list != nullptr){
+            Free* slot = list;
+            list = slot->next;
+            return slot;
+        }
+        if (left < grains * GRAIN){
+            if (used == blocks.size()){
+                blocks.emplace_back(new char[BLOCK]);
+            }
+            used++;
+            left = BLOCK;
+        }
+        left -= grains * GRAIN;
+        return blocks[used - 1].get() + left;
+    }
+
+    void release(void* pointer, const size_t& size){
+        size_t grains = (size + GRAIN - 1) / GRAIN;
+        if (grains > CLASSES){
+            ::operator delete(pointer);
+            return;
         }
-        tokens.push_back(str);
+        lock_guard<mutex> guard(lock);
+        live--;
+        Free* slot = (Free*)pointer;
+        slot->next = lists[grains - 1];
+        lists[grains - 1] = slot;
+    }
 
-        return tokens;
+    // O(1): `owned` counts the distinct pooled objects the caller holds. If that is every one alive, the caller
+    // promises to drop them without deleting; the free lists are forgotten and the blocks are handed out again
+    // from the first. Returns false and changes nothing if anything else is still alive.
+    bool reset(const size_t& owned){
+        lock_guard<mutex> guard(lock);
+        assert(owned <= live);
+        if (live != owned) return false;
+        fill(begin(lists), end(lists), nullptr);
+        used = 0;
+        left = 0;
+        live = 0;
+        return true;
     }
+};
 
+// State all shapes share and the helpers their rasterizers use. Shapes are plain classes without virtual
+// methods; Figure below holds exactly one of them.
+class Shape{
 public:
-     Parser(Blackboard* blackboard) : blackboard(blackboard) {}
+    static int id;
 
-    void parse_command(string& command_line) {
-    vector<string> parts = split(command_line, " ");
-    if (parts.empty()) {
-        cout << "Start typing" << endl;
-        return;
+    int get_id() const {
+        return s_id;
     }
 
-    string command = parts[0];
+    char get_symbol() const {
+        return Palette::instance().symbol(color);
+    }
 
-    if (command == "draw"){
-        blackboard->draw();
+    uint8_t get_color() const {
+        return color;
     }
-    else if (command == "list"){
-        blackboard->list();
+
+    bool is_filled() const {
+        return fill;
     }
-    else if (command == "shapes"){
-        blackboard->shapes();
+
+    bool get_placement() const {
+        return if_outside;
+    }
+
+    void set_color(const uint8_t& new_color){
+        color = new_color;
+    }
+
+protected:
+    int s_id;
+    tuple<int,int> coordinates;
+    bool if_outside = false;
+    uint8_t color;
+    bool fill;
+
+    Shape(const bool& fill, const uint8_t& color, const int& x, const int& y, const int& existing_id): s_id(existing_id),
+     coordinates(make_tuple(x,y)), color(color), fill(fill) { }
+
+    // Records and returns whether the figure misses the board. Sizes were checked before the figure was built.
+    bool check(const Rect& box, const int& right_bound, const int& up_bound){
+        return if_outside = outside(box, right_bound, up_bound);
+    }
+
+    // Writes cells [x0, x1] of board row y (y up), clipped to the board.
+    static void span(Framebuffer* framebuffer, const int& y, int x0, int x1, char symbol, uint8_t color_id, int figure_id){
+        int up_bound = framebuffer->get_height();
+        if (y < 0 || y >= up_bound){
+            return;
+        }
+        x0 = max(x0, 0);
+        x1 = min(x1, framebuffer->get_width() - 1);
+        if (x0 <= x1){
+            framebuffer->fill_span(up_bound - y - 1, x0, x1, symbol, color_id, figure_id);
+        }
+    }
+
+    // Part of the board the framebuffer accepts writes for, in board coordinates.
+    static Rect window(const Framebuffer* framebuffer){
+        int first_col, first_row, last_col, last_row;
+        framebuffer->clip_window(first_col, first_row, last_col, last_row);
+        int up_bound = framebuffer->get_height();
+        return {first_col, up_bound - 1 - last_row, last_col, up_bound - 1 - first_row};
+    }
+
+    // Figures must fit the board vertically but may run off its sides.
+    static bool outside(const Rect& box, const int& right_bound, const int& up_bound){
+        return box.y0 < 0 || box.y1 >= up_bound || box.x1 < 0 || box.x0 >= right_bound;
+    }
+};
+
+int Shape::id = 0;
+
+class Square: public Shape{
+private:
+    int size;
+
+public:
+    Square(bool fill, const uint8_t& color, const int& size, const int& x, const int& y): Shape(fill, color, x, y, id++), size(size) { }
+
+    Square(bool fill, const uint8_t& color, const int& size, const int& x, const int& y, const int& existing_id):
+     Shape(fill, color, x, y, existing_id), size(size) { }
+
+    bool place(const int& right_bound, const int& up_bound){
+        return check(bounds(), right_bound, up_bound);
+    }
+
+    // Clips the square against the board once, then writes it as horizontal spans: the top and bottom edges,
+    // and per interior row either one full span or the two side cells.
+    void rasterize(Framebuffer* framebuffer) const {
+        int up_bound = framebuffer->get_height();
+        Rect box = bounds();
+        Rect visible = box.intersect(window(framebuffer));
+        if (visible.empty()){
+            return;
+        }
+
+        char symbol = get_symbol();
+
+        for (int current_row = visible.y1; current_row >= visible.y0; current_row--) {
+            int row = up_bound - current_row - 1;
+
+            if (current_row == box.y1 || current_row == box.y0 || fill) {
+                framebuffer->fill_span(row, visible.x0, visible.x1, symbol, color, s_id);
+                continue;
+            }
+            if (box.x0 == visible.x0) {
+                framebuffer->put(box.x0, row, symbol, color, s_id);
+            }
+            if (box.x1 == visible.x1 && box.x1 != box.x0) {
+                framebuffer->put(box.x1, row, symbol, color, s_id);
+            }
+        }
+    }
+
+    Rect bounds() const {
+        int x = get<0>(coordinates);
+        int y = get<1>(coordinates);
+        return {x, y - size + 1, x + size - 1, y};
+    }
+
+    bool covers(const int& px, const int& py) const {
+        Rect box = bounds();
+        if (px < box.x0 || px > box.x1 || py < box.y0 || py > box.y1){
+            return false;
+        }
+        return fill || px == box.x0 || px == box.x1 || py == box.y0 || py == box.y1;
+    }
+
+    GeometryKey key() const {
+        return {SHAPE_SQUARE, {size, get<0>(coordinates), get<1>(coordinates), 0}};
+    }
+
+    Square resized(const int& new_size) const {
+        return Square(fill, color, new_size, get<0>(coordinates), get<1>(coordinates), s_id);
+    }
+
+    string describe() const {
+        stringstream info;
+        info << "Square: id(" << s_id << "), size( " << size << " ), coordinates( " << get<0>(coordinates) << "," << get<1>(coordinates)
+         << " ), color( " << Palette::instance().label(color) << " ), filled( "<< (fill ? "yes" : "no") <<" )\n";
+        return info.str();
+    }
+
+    string get_type() const {
+        return "Square";
+    }
+};
+
+// Isosceles triangle hanging down from its apex, one cell wider on each side per row.
+class Triangle: public Shape{
+private:
+    int height;
+
+public:
+    Triangle(bool fill, const uint8_t& color, const int& height, const int& x, const int& y): Shape(fill, color, x, y, id++),
+     height(height) { }
+
+    Triangle(bool fill, const uint8_t& color, const int& height, const int& x, const int& y, const int& existing_id):
+     Shape(fill, color, x, y, existing_id), height(height) { }
+
+    bool place(const int& right_bound, const int& up_bound){
+        return check(bounds(), right_bound, up_bound);
+    }
+
+    // Walks both edges down from the apex, one span per row when filled and the two edge cells otherwise;
+    // the base row is always solid.
+    void rasterize(Framebuffer* framebuffer) const {
+        char symbol = get_symbol();
+        Rect visible = window(framebuffer);
+        int y = get<1>(coordinates);
+        int base = y - height + 1;
+        int first = min(y, visible.y1);
+        int left = get<0>(coordinates) - (y - first);
+        int right = get<0>(coordinates) + (y - first);
+
+        for (int current_row = first; current_row >= max(base, visible.y0); current_row--, left--, right++){
+            if (fill || current_row == base){
+                span(framebuffer, current_row, left, right, symbol, color, s_id);
+                continue;
+            }
+            span(framebuffer, current_row, left, left, symbol, color, s_id);
+            if (right != left){
+                span(framebuffer, current_row, right, right, symbol, color, s_id);
+            }
+        }
+    }
+
+    Rect bounds() const {
+        int x = get<0>(coordinates);
+        int y = get<1>(coordinates);
+        return {x - height + 1, y - height + 1, x + height - 1, y};
+    }
+
+    bool covers(const int& px, const int& py) const {
+        int depth = get<1>(coordinates) - py;
+        int offset = abs(px - get<0>(coordinates));
+        if (depth < 0 || depth >= height || offset > depth){
+            return false;
+        }
+        return fill || offset == depth || depth == height - 1;
+    }
+
+    GeometryKey key() const {
+        return {SHAPE_TRIANGLE, {height, get<0>(coordinates), get<1>(coordinates), 0}};
+    }
+
+    Triangle resized(const int& new_size) const {
+        return Triangle(fill, color, new_size, get<0>(coordinates), get<1>(coordinates), s_id);
+    }
+
+    string describe() const {
+        stringstream info;
+        info << "Triangle: id(" << s_id << "), height( " << height << " ), coordinates( " << get<0>(coordinates) << "," << get<1>(coordinates)
+         << " ), color( " << Palette::instance().label(color) << " ), filled( "<< (fill ? "yes" : "no") <<" )\n";
+        return info.str();
+    }
+
+    string get_type() const {
+        return "Triangle";
+    }
+};
+
+class Circle: public Shape{
+private:
+    int radius;
+
+    // Largest y with a*a + y*(y-1) < r*r, i.e. the row the midpoint walk is on at column a; -1 past the radius.
+    static long long walk_row(const long long& a, const long long& r){
+        long long n = r * r - a * a;
+        if (n <= 0) return -1;
+        long long y = (long long)((1 + sqrt(4.0 * n)) / 2);
+        while (y * (y - 1) >= n) y--;
+        while ((y + 1) * y < n) y++;
+        return y;
+    }
+
+    // Outermost cell of row dy (0 <= dy <= radius) plotted by the midpoint walk, in closed form so hit tests
+    // do not have to replay it. Below the diagonal the walk plots (walk_row(dy), dy), above it the run ends at
+    // the last column whose walk row is still dy.
+    long long half_width(const long long& dy) const {
+        if (dy > radius) return -1;
+        long long y = walk_row(dy, radius);
+        if (dy <= y) return y;
+        long long n = (long long)radius * radius - dy * (dy - 1) - 1;
+        long long x = (long long)sqrt((double)n);
+        while (x * x > n) x--;
+        while ((x + 1) * (x + 1) <= n) x++;
+        return x;
+    }
+
+public:
+    Circle(bool fill, const uint8_t& color, const int& radius, const int& x, const int& y): Shape(fill, color, x, y, id++),
+     radius(radius) { }
+
+    Circle(bool fill, const uint8_t& color, const int& radius, const int& x, const int& y, const int& existing_id):
+     Shape(fill, color, x, y, existing_id), radius(radius) { }
+
+    bool place(const int& right_bound, const int& up_bound){
+        return check(bounds(), right_bound, up_bound);
+    }
+
+    // Midpoint circle, row by row within the framebuffer's window: half_width() gives the outermost column the walk
+    // plots on every row, and each row is written as one span when filled, or as the two runs between this row's
+    // and the next row's outermost column.
+    void rasterize(Framebuffer* framebuffer) const {
+        char symbol = get_symbol();
+        int cx = get<0>(coordinates);
+        int cy = get<1>(coordinates);
+        Rect visible = window(framebuffer);
+
+        auto row = [&](const int& dy, const int& current_row){
+            int outer = (int)half_width(dy);
+            int inner = fill ? 0 : (int)min(half_width(dy + 1) + 1, (long long)outer);
+            if (inner == 0){
+                span(framebuffer, current_row, cx - outer, cx + outer, symbol, color, s_id);
+            }
+            else {
+                span(framebuffer, current_row, cx - outer, cx - inner, symbol, color, s_id);
+                span(framebuffer, current_row, cx + inner, cx + outer, symbol, color, s_id);
+            }
+        };
+        for (int dy = max(1, visible.y0 - cy); dy <= min(radius, visible.y1 - cy); dy++){
+            row(dy, cy + dy);
+        }
+        for (int dy = max(0, cy - visible.y1); dy <= min(radius, cy - visible.y0); dy++){
+            row(dy, cy - dy);
+        }
+    }
+
+    Rect bounds() const {
+        int x = get<0>(coordinates);
+        int y = get<1>(coordinates);
+        return {x - radius, y - radius, x + radius, y + radius};
+    }
+
+    bool covers(const int& px, const int& py) const {
+        long long dx = abs((long long)px - get<0>(coordinates));
+        long long dy = abs((long long)py - get<1>(coordinates));
+        long long outer = half_width(dy);
+        if (dx > outer){
+            return false;
+        }
+        return fill || dx >= min(half_width(dy + 1) + 1, outer);
+    }
+
+    GeometryKey key() const {
+        return {SHAPE_CIRCLE, {radius, get<0>(coordinates), get<1>(coordinates), 0}};
+    }
+
+    Circle resized(const int& new_size) const {
+        return Circle(fill, color, new_size, get<0>(coordinates), get<1>(coordinates), s_id);
+    }
+
+    string describe() const {
+        stringstream info;
+        info << "Circle: id(" << s_id << "), radius( " << radius << " ), coordinates( " << get<0>(coordinates) << "," << get<1>(coordinates)
+         << " ), color( " << Palette::instance().label(color) << " ), filled( "<< (fill ? "yes" : "no") <<" )\n";
+        return info.str();
+    }
+
+    string get_type() const {
+        return "Circle";
+    }
+};
+
+// Segment of `length` cells from its start point at `angle` degrees counterclockwise from the x axis. Lines are never filled.
+class Line: public Shape{
+private:
+    int length;
+    int angle;
+    tuple<int, int> end;
+
+    // The angle is only used once to round the far end to a cell; every cell in between comes from integer stepping.
+    static tuple<int, int> end_point(const int& length, const int& angle, const int& x, const int& y){
+        double rad_angle = angle * M_PI / 180.0;
+        return make_tuple(x + (int)lround((length - 1) * cos(rad_angle)), y + (int)lround((length - 1) * sin(rad_angle)));
+    }
+
+public:
+    Line(const uint8_t& color, const int& length, const int& angle, const int& x, const int& y): Line(color, length, angle, x, y, id++) { }
+
+    Line(const uint8_t& color, const int& length, const int& angle, const int& x, const int& y, const int& existing_id):
+     Shape(false, color, x, y, existing_id), length(length), angle((angle % 360 + 360) % 360), end(end_point(length, this->angle, x, y)) { }
+
+    bool place(const int& right_bound, const int& up_bound){
+        return check(bounds(), right_bound, up_bound);
+    }
+
+    // Bresenham along the major axis. Shallow lines are written as one span per run of cells on the same row,
+    // steep lines as one cell per row. Rows only move away from the start as the walk goes on, so the cells in the
+    // rows of the framebuffer's window are one stretch of it; the walk starts there, with the error term it would
+    // have had, and stops where the stretch ends.
+    void rasterize(Framebuffer* framebuffer) const {
+        char symbol = get_symbol();
+        auto [x0, y0] = coordinates;
+        auto [x1, y1] = end;
+        int sx = x1 >= x0 ? 1 : -1;
+        int sy = y1 >= y0 ? 1 : -1;
+        bool steep = abs(y1 - y0) > abs(x1 - x0);
+        long long major = max(abs(x1 - x0), abs(y1 - y0));
+        long long minor = min(abs(x1 - x0), abs(y1 - y0));
+
+        // Steps off the major axis at cell k, and rows away from the start.
+        auto offset = [&](const long long& k){ return major == 0 ? 0 : (2 * k * minor + major) / (2 * major); };
+        auto rows = [&](const long long& k){ return steep ? k : offset(k); };
+        // First cell of the walk more than `limit` rows away from the start.
+        auto beyond = [&](const long long& limit){
+            long long low = 0, high = major + 1;
+            while (low < high){
+                long long middle = (low + high) / 2;
+                if (rows(middle) > limit) high = middle;
+                else low = middle + 1;
+            }
+            return low;
+        };
+        Rect visible = window(framebuffer);
+        long long nearest = sy > 0 ? (long long)visible.y0 - y0 : (long long)y0 - visible.y1;
+        long long farthest = sy > 0 ? (long long)visible.y1 - y0 : (long long)y0 - visible.y0;
+        int begin = (int)beyond(nearest - 1);
+        int finish = (int)beyond(farthest) - 1;
+
+        int step = (int)offset(begin);
+        long long error = major + 2 * begin * minor - 2 * major * step;
+        int run = begin;
+        for (int k = begin; k <= finish; k++){
+            int next = step;
+            error += 2 * minor;
+            if (error >= 2 * major){
+                error -= 2 * major;
+                next++;
+            }
+            if (steep){
+                span(framebuffer, y0 + sy * k, x0 + sx * step, x0 + sx * step, symbol, color, s_id);
+            }
+            else if (next != step || k == major){
+                int first = x0 + sx * run;
+                int last = x0 + sx * k;
+                span(framebuffer, y0 + sy * step, min(first, last), max(first, last), symbol, color, s_id);
+                run = k + 1;
+            }
+            step = next;
+        }
+    }
+
+    Rect bounds() const {
+        auto [x0, y0] = coordinates;
+        auto [x1, y1] = end;
+        return {min(x0, x1), min(y0, y1), max(x0, x1), max(y0, y1)};
+    }
+
+    // Cell k of the walk sits `(2k*minor + major) / (2*major)` steps off the major axis.
+    bool covers(const int& px, const int& py) const {
+        auto [x0, y0] = coordinates;
+        auto [x1, y1] = end;
+        long long sx = x1 >= x0 ? 1 : -1;
+        long long sy = y1 >= y0 ? 1 : -1;
+        bool steep = abs(y1 - y0) > abs(x1 - x0);
+        long long major = max(abs(x1 - x0), abs(y1 - y0));
+        long long minor = min(abs(x1 - x0), abs(y1 - y0));
+
+        long long k = steep ? (py - y0) * sy : (px - x0) * sx;
+        if (k < 0 || k > major){
+            return false;
+        }
+        long long step = major == 0 ? 0 : (2 * k * minor + major) / (2 * major);
+        return steep ? px == x0 + sx * step : py == y0 + sy * step;
+    }
+
+    GeometryKey key() const {
+        return {SHAPE_LINE, {length, angle, get<0>(coordinates), get<1>(coordinates)}};
+    }
+
+    Line resized(const int& new_size) const {
+        return Line(color, new_size, angle, get<0>(coordinates), get<1>(coordinates), s_id);
+    }
+
+    string describe() const {
+        stringstream info;
+        info << "Line: id(" << s_id << "), length( " << length << " ), angle( " << angle << " ), coordinates( " << get<0>(coordinates) << ","
+         << get<1>(coordinates) << " ), color( " << Palette::instance().label(color) << " )\n";
+        return info.str();
+    }
+
+    string get_type() const {
+        return "Line";
+    }
+};
+
+// A figure on the board: one shape out of the closed set plus its place in the z order. Every call is a
+// switch over the shape kind into a non-virtual, inlinable member, so per-figure loops need neither vtables
+// nor RTTI. All figures have the same size and come from one size class of the pool.
+class Figure{
+private:
+    variant<Square, Triangle, Circle, Line> shape;
+
+public:
+    uint64_t z = 0;
+
+    template <typename Kind, typename = enable_if_t<is_base_of_v<Shape, Kind>>>
+    explicit Figure(const Kind& kind) : shape(kind) {}
+
+    static void* operator new(size_t size){
+        return FigurePool::instance().allocate(size);
+    }
+
+    static void operator delete(void* pointer, size_t size){
+        FigurePool::instance().release(pointer, size);
+    }
+
+    // Draws the figure unless it does not fit the board.
+    void add(Framebuffer* framebuffer){
+        if (!place(framebuffer->get_width(), framebuffer->get_height())){
+            rasterize(framebuffer);
+        }
+    }
+
+    // Writes the cells of an already placed figure. It is const, so several threads may draw the same figure
+    // into different parts of the board.
+    void rasterize(Framebuffer* framebuffer) const {
+        visit([&](const auto& kind){ kind.rasterize(framebuffer); }, shape);
+    }
+
+    Rect bounds() const {
+        return visit([](const auto& kind){ return kind.bounds(); }, shape);
+    }
+
+    bool covers(const int& x, const int& y) const {
+        return visit([&](const auto& kind){ return kind.covers(x, y); }, shape);
+    }
+
+    GeometryKey key() const {
+        return visit([](const auto& kind){ return kind.key(); }, shape);
+    }
+
+    bool place(const int& width, const int& height){
+        return visit([&](auto& kind){ return kind.place(width, height); }, shape);
+    }
+
+    unique_ptr<Figure> resized(const int& new_size) const {
+        return visit([&](const auto& kind){ return make_unique<Figure>(kind.resized(new_size)); }, shape);
+    }
+
+    // One line about the figure, as list prints it and text saves store it.
+    string describe() const {
+        return visit([](const auto& kind){ return kind.describe(); }, shape);
+    }
+
+    const string get_info() const {
+        string info = describe();
+        console() << info;
+        return info;
+    }
+
+    string get_type() const {
+        return visit([](const auto& kind){ return kind.get_type(); }, shape);
+    }
+
+    // Same shape kind and geometry; color and fill are ignored, as for duplicate checks.
+    bool operator==(const Figure& other) const {
+        return key() == other.key();
+    }
+
+    // The shared state lives in the Shape base of every alternative.
+    const Shape& common() const {
+        return visit([](const Shape& kind) -> const Shape& { return kind; }, shape);
+    }
+
+    int get_id() const { return common().get_id(); }
+    char get_symbol() const { return common().get_symbol(); }
+    uint8_t get_color() const { return common().get_color(); }
+    bool is_filled() const { return common().is_filled(); }
+    bool get_placement() const { return common().get_placement(); }
+
+    void set_color(const uint8_t& color){
+        visit([&](Shape& kind){ kind.set_color(color); }, shape);
+    }
+};
+
+// A cleared board drops its figures without running destructors; see FigurePool::reset.
+static_assert(is_trivially_destructible_v<Figure>, "figures must be safe to drop without destruction");
+
+// Part of the board shown by draw, in rows counted from the top of the board.
+struct Viewport{
+    int col, row, width, height;
+
+    bool operator==(const Viewport& other) const {
+        return col == other.col && row == other.row && width == other.width && height == other.height;
+    }
+};
+
+// Builds a whole frame in one reusable buffer and writes it out at once.
+// Color escapes are only emitted when the color changes along a row; blanks never switch color.
+// In live mode it also keeps the last presented frame so later updates only repaint changed cells.
+// The frame buffer is per thread, so plain renders of the same board may run concurrently.
+class Renderer{
+private:
+    static thread_local string frame;
+    static thread_local uint8_t current;
+    const uint8_t border = named_color("red");
+
+    bool live = false;
+    bool presented = false;
+    Viewport shown = {0, 0, 0, 0};
+    vector<char> shown_glyph;
+    vector<uint8_t> shown_color;
+
+    void set_color(const uint8_t& color){
+        if (color != current){
+            frame += Palette::instance().code(color);
+            current = color;
+        }
+    }
+
+    void append_edge(const int& width){
+        frame += ' ';
+        set_color(border);
+        frame.append(width + 1, '-');
+        frame += '\n';
+    }
+
+    void move_cursor(const int& screen_row, const int& screen_col){
+        frame += "\033[";
+        frame += to_string(screen_row);
+        frame += ';';
+        frame += to_string(screen_col);
+        frame += 'H';
+    }
+
+    void flush(){
+        console().write(frame.data(), frame.size());
+        console().flush();
+    }
+public:
+    bool is_live() const { return live; }
+
+    // Leaving live mode gives the output area back the whole screen.
+    void set_live(const bool& enabled){
+        if (live && !enabled){
+            frame = "\033[r";
+            flush();
+        }
+        live = enabled;
+        presented = false;
+    }
+
+    // Draws from the live framebuffer or from a frozen copy of it; only the live framebuffer has damage to clear.
+    template <typename Raster>
+    void render(Raster& raster, const Viewport& view){
+        frame.clear();
+        frame.reserve((size_t)(view.width * 6 + 16) * (view.height + 2));
+        current = 0;
+
+        // In live mode the board keeps the top of the screen and command output scrolls in the rows below it. A new
+        // view clears the screen; a repaint of the same one leaves the output area alone.
+        bool fresh = live && (!presented || !(view == shown));
+        if (fresh){
+            frame += "\033[r\033[2J\033[H";
+        }
+        else if (live){
+            frame += "\0337\033[H";
+        }
+        if (live){
+            shown = view;
+            shown_glyph.assign((size_t)view.width * view.height, ' ');
+            shown_color.assign((size_t)view.width * view.height, 0);
+        }
+
+        append_edge(view.width);
+        for (int row = view.row; row < view.row + view.height; row++) {
+            set_color(border);
+            frame += '|';
+            // Walk the row one tile at a time; unallocated tiles are plain blanks.
+            for (int col = view.col; col < view.col + view.width;) {
+                int end = min(view.col + view.width, ((col >> TILE_SHIFT) + 1) << TILE_SHIFT);
+                const Tile* tile = raster.tile_at(col, row);
+
+                if (tile == nullptr){
+                    frame.append(end - col, ' ');
+                    col = end;
+                    continue;
+                }
+                for (; col < end; col++) {
+                    int i = Framebuffer::cell_offset(col, row);
+                    if (tile->top[i] != -1){
+                        set_color(tile->color[i]);
+                        frame += tile->glyph[i];
+                    }
+                    else{
+                        frame += ' ';
+                    }
+                    if (live){
+                        size_t shown_index = (size_t)(row - view.row) * view.width + (col - view.col);
+                        shown_glyph[shown_index] = tile->glyph[i];
+                        shown_color[shown_index] = tile->color[i];
+                    }
+                }
+            }
+            set_color(border);
+            frame += " |\n";
+        }
+        append_edge(view.width);
+        frame += RESET;
+
+        if (fresh){
+            frame += "\033[";
+            frame += to_string(view.height + 3);
+            frame += 'r';
+            move_cursor(view.height + 3, 1);
+        }
+        else if (live){
+            frame += "\0338";
+        }
+        if (live){
+            if constexpr (is_same_v<Raster, Framebuffer>) raster.clear_damage();
+            presented = true;
+        }
+        flush();
+    }
+
+    // Repaints only the cells of damaged tiles that differ from the presented frame, then puts the cursor back where
+    // command output left it. Without damage nothing is written.
+    void update(Framebuffer& framebuffer, const Viewport& view){
+        if (!presented || !(view == shown) || framebuffer.is_damaged_all()){
+            render(framebuffer, view);
+            return;
+        }
+
+        vector<uint64_t> keys = framebuffer.damaged_tiles();
+        if (keys.empty()) return;
+        sort(keys.begin(), keys.end());
+
+        frame.clear();
+        frame += "\0337";
+        current = 0xFF;
+        int cursor_row = -1;
+        int cursor_col = -1;
+
+        for (uint64_t key : keys) {
+            int tile_col = (int)(uint32_t)key << TILE_SHIFT;
+            int tile_row = (int)(key >> 32) << TILE_SHIFT;
+            int first_col = max(view.col, tile_col);
+            int first_row = max(view.row, tile_row);
+            int last_col = min(view.col + view.width, tile_col + TILE_SIZE);
+            int last_row = min(view.row + view.height, tile_row + TILE_SIZE);
+
+            for (int row = first_row; row < last_row; row++) {
+                for (int col = first_col; col < last_col; col++) {
+                    size_t i = (size_t)(row - view.row) * view.width + (col - view.col);
+                    char symbol = framebuffer.glyph_at(col, row);
+                    uint8_t color = framebuffer.color_at(col, row);
+
+                    if (shown_glyph[i] == symbol && shown_color[i] == color){
+                        continue;
+                    }
+                    if (cursor_row != row || cursor_col != col){
+                        move_cursor(row - view.row + 2, col - view.col + 2);
+                    }
+                    if (framebuffer.top_at(col, row) != -1){
+                        set_color(color);
+                    }
+                    frame += symbol;
+                    shown_glyph[i] = symbol;
+                    shown_color[i] = color;
+                    cursor_row = row;
+                    cursor_col = col + 1;
+                }
+            }
+        }
+        framebuffer.clear_damage();
+
+        frame += RESET;
+        frame += "\0338";
+        flush();
+    }
+};
+
+thread_local string Renderer::frame;
+thread_local uint8_t Renderer::current;
+
+// Bucket grids over figure bounding boxes, clipped to the board, plus an exact-geometry table for duplicates.
+// Level L has buckets of 16 << L cells; a figure goes to the first level whose buckets are at least as large
+// as its box, so it lands in at most four buckets whatever its size. Lookups visit every level holding figures.
+// Buckets and geometry entries carry the epoch they were filled in, so a clear only starts a new epoch; stale
+// entries read as empty and are reused by the next insert, as the framebuffer does with its tiles.
+class SpatialIndex{
+private:
+    static const int BUCKET_SHIFT = 4;
+    static const int LEVELS = 28;
+
+    struct Bucket{
+        uint32_t epoch;
+        vector<Figure*> list;
+    };
+
+    Rect board;
+    uint32_t epoch = 0;
+    unordered_map<uint64_t, Bucket> levels[LEVELS];
+    // Buckets of each level that belong to the current epoch.
+    size_t occupied[LEVELS] = {};
+    unordered_map<GeometryKey, pair<Figure*, uint32_t>, GeometryHash> geometry;
+    size_t figure_count = 0;
+
+    static uint64_t bucket_key(const int& bx, const int& by) { return (uint64_t)(uint32_t)bx << 32 | (uint32_t)by; }
+
+    static int level_of(const Rect& area){
+        int64_t extent = max((int64_t)area.x1 - area.x0, (int64_t)area.y1 - area.y0) + 1;
+        int level = 0;
+        while (level < LEVELS - 1 && ((int64_t)1 << (BUCKET_SHIFT + level)) < extent) level++;
+        return level;
+    }
+
+    template <typename Visit>
+    static void for_each_bucket(const Rect& area, const int& shift, Visit visit){
+        for (int by = area.y0 >> shift; by <= area.y1 >> shift; by++){
+            for (int bx = area.x0 >> shift; bx <= area.x1 >> shift; bx++){
+                visit(bx, by);
+            }
+        }
+    }
+public:
+    SpatialIndex(const int& width, const int& height) : board{0, 0, width - 1, height - 1} {}
+
+    void insert(Figure* figure){
+        geometry[figure->key()] = {figure, epoch};
+        figure_count++;
+        Rect area = figure->bounds().intersect(board);
+        if (area.empty()) return;
+        int level = level_of(area);
+        for_each_bucket(area, BUCKET_SHIFT + level, [&](const int& bx, const int& by){
+            Bucket& bucket = levels[level][bucket_key(bx, by)];
+            if (bucket.list.empty() || bucket.epoch != epoch){
+                bucket.epoch = epoch;
+                bucket.list.clear();
+                occupied[level]++;
+            }
+            bucket.list.push_back(figure);
+        });
+    }
+
+    void erase(Figure* figure){
+        geometry.erase(figure->key());
+        figure_count--;
+        Rect area = figure->bounds().intersect(board);
+        if (area.empty()) return;
+        int level = level_of(area);
+        auto& buckets = levels[level];
+        for_each_bucket(area, BUCKET_SHIFT + level, [&](const int& bx, const int& by){
+            auto bucket = buckets.find(bucket_key(bx, by));
+            if (bucket == buckets.end() || bucket->second.epoch != epoch) return;
+            auto& list = bucket->second.list;
+            list.erase(std::remove(list.begin(), list.end(), figure), list.end());
+            if (list.empty()){
+                buckets.erase(bucket);
+                occupied[level]--;
+            }
+        });
+    }
+
+    Figure* find(const GeometryKey& key) const {
+        auto found = geometry.find(key);
+        return found == geometry.end() || found->second.second != epoch ? nullptr : found->second.first;
+    }
+
+    // Topmost figure whose footprint covers the point.
+    Figure* hit(const int& x, const int& y) const {
+        if (x < board.x0 || x > board.x1 || y < board.y0 || y > board.y1) return nullptr;
+        Figure* found = nullptr;
+        for (int level = 0; level < LEVELS; level++){
+            if (occupied[level] == 0) continue;
+            int shift = BUCKET_SHIFT + level;
+            auto bucket = levels[level].find(bucket_key(x >> shift, y >> shift));
+            if (bucket == levels[level].end() || bucket->second.epoch != epoch) continue;
+            for (Figure* figure : bucket->second.list){
+                if ((found == nullptr || figure->z > found->z) && figure->covers(x, y)){
+                    found = figure;
+                }
+            }
+        }
+        return found;
+    }
+
+    // Figures whose bounding box intersects the area, each reported once: from the bucket holding the corner of
+    // its overlap with the area. A level with fewer occupied buckets than the area spans is scanned instead.
+    vector<Figure*> query(const Rect& area){
+        vector<Figure*> result;
+        Rect clipped = area.intersect(board);
+        if (clipped.empty()) return result;
+
+        for (int level = 0; level < LEVELS; level++){
+            auto& buckets = levels[level];
+            if (occupied[level] == 0) continue;
+            int shift = BUCKET_SHIFT + level;
+            auto report = [&](const int& bx, const int& by, const Bucket& bucket){
+                if (bucket.epoch != epoch) return;
+                for (Figure* figure : bucket.list){
+                    Rect overlap = figure->bounds().intersect(clipped);
+                    if (!overlap.empty() && overlap.x0 >> shift == bx && overlap.y0 >> shift == by){
+                        result.push_back(figure);
+                    }
+                }
+            };
+
+            uint64_t spanned = (uint64_t)((clipped.x1 >> shift) - (clipped.x0 >> shift) + 1) * ((clipped.y1 >> shift) - (clipped.y0 >> shift) + 1);
+            if (spanned > buckets.size()){
+                for (auto& [key, bucket] : buckets){
+                    report((int)(key >> 32), (int)(uint32_t)key, bucket);
+                }
+            }
+            else for_each_bucket(clipped, shift, [&](const int& bx, const int& by){
+                auto bucket = buckets.find(bucket_key(bx, by));
+                if (bucket != buckets.end()) report(bx, by, bucket->second);
+            });
+        }
+        return result;
+    }
+
+    // O(1) apart from pruning: a new epoch empties every bucket. Maps mostly made of stale entries are dropped,
+    // which costs no more than the inserts that filled them.
+    void clear(){
+        epoch++;
+        for (int level = 0; level < LEVELS; level++){
+            if (levels[level].size() > 2 * occupied[level] + 1024){
+                levels[level].clear();
+            }
+            occupied[level] = 0;
+        }
+        if (geometry.size() > 2 * figure_count + 1024){
+            geometry.clear();
+        }
+        figure_count = 0;
+    }
+};
+
+// Read-only copy of the figure list in z order, in chunks that mirror CHUNK slots of the table each. Chunks are
+// shared between copies until a figure in them changes, so a new copy costs the changed chunks and a pointer per
+// chunk.
+class FrozenFigures{
+private:
+    using Chunk = vector<Figure>;
+
+    vector<shared_ptr<const Chunk>> chunks;
+    size_t count = 0;
+
+    friend class FigureTable;
+public:
+    static const size_t CHUNK = 256;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    template <typename Visit>
+    void for_each(Visit visit) const {
+        for (auto& chunk : chunks){
+            for (const Figure& figure : *chunk) visit(figure);
+        }
+    }
+};
+
+// Figures in z order with O(1) lookup by id. Removal leaves a tombstone so slots never shift;
+// tombstones keep their z so a figure brought back by undo finds its old place. Slots own their figures
+// through plain pointers, so that a clear can hand them all back to the pool at once.
+class FigureTable{
+private:
+    vector<Figure*> slots;
+    vector<uint64_t> slot_z;
+    vector<int> slot_of_id;
+    size_t live = 0;
+    // What changed since the last freeze: listed chunks, plus every chunk from slot `shifted` on.
+    vector<size_t> changed;
+    vector<bool> chunk_changed;
+    size_t shifted = 0;
+
+    void mark(const size_t& slot){
+        size_t chunk = slot / FrozenFigures::CHUNK;
+        if (chunk >= chunk_changed.size()){
+            chunk_changed.resize(chunk + 1);
+        }
+        if (!chunk_changed[chunk]){
+            chunk_changed[chunk] = true;
+            changed.push_back(chunk);
+        }
+    }
+
+    void compact(){
+        size_t next = 0;
+        for (size_t i = 0; i < slots.size(); i++){
+            if (slots[i]){
+                slot_of_id[slots[i]->get_id()] = next;
+                slot_z[next] = slot_z[i];
+                slots[next++] = slots[i];
+            }
+        }
+        slots.resize(next);
+        slot_z.resize(next);
+        shifted = 0;
+    }
+public:
+    FigureTable() = default;
+    FigureTable(const FigureTable&) = delete;
+    FigureTable& operator=(const FigureTable&) = delete;
+
+    ~FigureTable(){
+        clear(false);
+    }
+
+    Figure* get(const int& id) const {
+        if (id < 0 || id >= (int)slot_of_id.size() || slot_of_id[id] == -1){
+            return nullptr;
+        }
+        return slots[slot_of_id[id]];
+    }
+
+    void place(unique_ptr<Figure> figure){
+        int id = figure->get_id();
+        assert(id >= 0 && get(id) == nullptr);
+        if (id >= (int)slot_of_id.size()){
+            slot_of_id.resize(max((size_t)id + 1, slot_of_id.size() * 2), -1);
+        }
+
+        size_t slot = lower_bound(slot_z.begin(), slot_z.end(), figure->z) - slot_z.begin();
+        if (slot < slots.size() && slot_z[slot] == figure->z && !slots[slot]){
+            slots[slot] = figure.release();
+            mark(slot);
+        }
+        else{
+            shifted = min(shifted, slot);
+            slots.insert(slots.begin() + slot, figure.release());
+            slot_z.insert(slot_z.begin() + slot, slots[slot]->z);
+            for (size_t i = slot + 1; i < slots.size(); i++){
+                if (slots[i]) slot_of_id[slots[i]->get_id()] = i;
+            }
+        }
+        slot_of_id[id] = slot;
+        live++;
+    }
+
+    unique_ptr<Figure> take(const int& id){
+        int slot = slot_of_id[id];
+        unique_ptr<Figure> figure(slots[slot]);
+        slots[slot] = nullptr;
+        slot_of_id[id] = -1;
+        mark(slot);
+        live--;
+
+        if (slots.size() > 64 && live < slots.size() / 2){
+            compact();
+        }
+        return figure;
+    }
+
+    // Lookup for a change made in place, such as a restyle, so that the next freeze copies the figure again.
+    Figure* modify(const int& id){
+        mark(slot_of_id[id]);
+        return slots[slot_of_id[id]];
+    }
+
+    template <typename Visit>
+    void for_each(Visit visit) const {
+        for (Figure* figure : slots){
+            if (figure) visit(figure);
+        }
+    }
+
+    size_t size() const { return live; }
+
+    // Brings `frozen` up to date with the table, copying only the chunks that changed since the last call.
+    void freeze(FrozenFigures& frozen){
+        const size_t CHUNK = FrozenFigures::CHUNK;
+        size_t chunk_count = (slots.size() + CHUNK - 1) / CHUNK;
+        frozen.chunks.resize(chunk_count);
+        auto copy = [&](const size_t& chunk){
+            auto figures = make_shared<FrozenFigures::Chunk>();
+            for (size_t slot = chunk * CHUNK; slot < min(slots.size(), (chunk + 1) * CHUNK); slot++){
+                if (slots[slot]) figures->push_back(*slots[slot]);
+            }
+            frozen.chunks[chunk] = move(figures);
+        };
+        for (size_t chunk : changed){
+            if (chunk < chunk_count && chunk < shifted / CHUNK) copy(chunk);
+            chunk_changed[chunk] = false;
+        }
+        for (size_t chunk = shifted / CHUNK; chunk < chunk_count; chunk++){
+            copy(chunk);
+        }
+        changed.clear();
+        shifted = SIZE_MAX;
+        frozen.count = live;
+    }
+
+    // Empties the table. With `abandon` the figures are dropped without being deleted, after FigurePool::reset
+    // took their memory back, and the storage is swapped for fresh vectors in O(1).
+    void clear(const bool& abandon){
+        if (!abandon){
+            for (Figure* figure : slots){
+                delete figure;
+            }
+        }
+        vector<Figure*>().swap(slots);
+        vector<uint64_t>().swap(slot_z);
+        vector<int>().swap(slot_of_id);
+        vector<size_t>().swap(changed);
+        vector<bool>().swap(chunk_changed);
+        shifted = 0;
+        live = 0;
+    }
+};
+
+// Figure-level part of a command. `held` owns the figure while it is off the board,
+// so applying and reverting just move it between the board and the record.
+struct FigureChange{
+    enum Kind { Insert, Erase, Restyle };
+
+    Kind kind;
+    int figure_id;
+    unique_ptr<Figure> held;
+    uint8_t color;
+};
+
+struct Command{
+    Journal cells;
+    vector<FigureChange> figures;
+    size_t bytes = 0;
+    // Raster generation the cell records were taken against; -1 when there are none, because the command ran with
+    // rasterization deferred or left the board to be rebuilt.
+    long generation = -1;
+
+    bool empty() const { return cells.empty() && figures.empty(); }
+
+    // Figures move in and out of `held` as the command is undone and redone, so every one is counted.
+    void measure(){
+        bytes = sizeof(Command) + cells.bytes() + figures.capacity() * (sizeof(FigureChange) + sizeof(Figure));
+    }
+};
+
+class History{
+private:
+    deque<Command> done;
+    vector<Command> undone;
+    size_t bytes = 0;
+    size_t limit;
+
+    void trim(){
+        while (bytes > limit && !done.empty()){
+            bytes -= done.front().bytes;
+            done.pop_front();
+        }
+    }
+public:
+    History(const size_t& limit) : limit(limit) {}
+
+    void push(Command&& command){
+        for (auto& redo : undone){
+            bytes -= redo.bytes;
+        }
+        undone.clear();
+        command.measure();
+        bytes += command.bytes;
+        done.push_back(move(command));
+        trim();
+    }
+
+    bool can_undo() const { return !done.empty(); }
+    bool can_redo() const { return !undone.empty(); }
+
+    Command& last_done() { return done.back(); }
+    Command& last_undone() { return undone.back(); }
+
+    void step_back(){
+        undone.push_back(move(done.back()));
+        done.pop_back();
+    }
+
+    void step_forward(){
+        done.push_back(move(undone.back()));
+        undone.pop_back();
+    }
+
+    void set_limit(const size_t& new_limit){
+        limit = new_limit;
+        trim();
+    }
+
+    size_t get_limit() const { return limit; }
+    size_t get_bytes() const { return bytes; }
+    size_t undo_steps() const { return done.size(); }
+    size_t redo_steps() const { return undone.size(); }
+
+    // Calls `visit` with every figure the commands hold while it is off the board.
+    template <typename Visit>
+    void for_each_held(Visit visit) const {
+        auto held = [&](const Command& command){
+            for (auto& change : command.figures){
+                if (change.held) visit(change.held.get());
+            }
+        };
+        for_each(done.begin(), done.end(), held);
+        for_each(undone.begin(), undone.end(), held);
+    }
+
+    // Marks the colors undo or redo could bring back: those of the figures held and those restyles swap in.
+    void colors(bool* used) const {
+        auto mark = [&](const Command& command){
+            for (auto& change : command.figures){
+                if (change.held) used[change.held->get_color()] = true;
+                used[change.color] = true;
+            }
+        };
+        for_each(done.begin(), done.end(), mark);
+        for_each(undone.begin(), undone.end(), mark);
+    }
+
+    // With `abandon` the held figures are dropped without being deleted; see FigureTable::clear.
+    void clear(const bool& abandon){
+        if (abandon){
+            auto drop = [](Command& command){
+                for (auto& change : command.figures) change.held.release();
+            };
+            for_each(done.begin(), done.end(), drop);
+            for_each(undone.begin(), undone.end(), drop);
+        }
+        done.clear();
+        undone.clear();
+        bytes = 0;
+    }
+};
+
+// Log-bucketed histogram in the style of HDR histograms: values below 8 get their own bucket, larger ones
+// 8 buckets per power of two, so every value is reported within 12.5% at a fixed 4 KB per histogram.
+class Histogram{
+private:
+    static const int SUB_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t highest = 0;
+
+    static int bucket(const uint64_t& value){
+        if (value < SUB_BUCKETS) return value;
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Largest value that falls into a bucket.
+    static uint64_t upper(const int& index){
+        if (index < SUB_BUCKETS) return index;
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t mantissa = SUB_BUCKETS + index % SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+public:
+    void record(const uint64_t& value){
+        counts[bucket(value)]++;
+        total++;
+        sum += value;
+        highest = max(highest, value);
+    }
+
+    uint64_t count() const { return total; }
+    double mean() const { return total ? (double)sum / total : 0; }
+    uint64_t max_value() const { return highest; }
+
+    // Smallest bucket bound that at least a `fraction` of the recorded values do not exceed.
+    uint64_t percentile(const double& fraction) const {
+        uint64_t wanted = max<uint64_t>(1, (uint64_t)ceil(fraction * total));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++){
+            seen += counts[i];
+            if (seen >= wanted) return min(upper(i), highest);
+        }
+        return highest;
+    }
+};
+
+// Counters behind the stats command: latency of every parsed command by name, latency of the board's internal
+// operations, and cells written by each rasterization.
+class Stats{
+public:
+    enum Operation { Rasterize, Rebuild, Render, Undo, Redo, Freeze, Save, Autosave, OPERATIONS };
+
+private:
+    map<string, Histogram, less<>> commands;
+    Histogram operations[OPERATIONS];
+    // Cells written by rasterizations, bytes written by saves.
+    Histogram cells[OPERATIONS];
+    // Server workers record concurrently.
+    mutable mutex lock;
+
+    static string duration(const double& ns){
+        stringstream text;
+        text.precision(ns < 1e3 ? 0 : ns < 1e4 ? 2 : 1);
+        if (ns < 1e3) text << fixed << ns << " ns";
+        else if (ns < 1e6) text << fixed << ns / 1e3 << " us";
+        else text << fixed << ns / 1e6 << " ms";
+        return text.str();
+    }
+
+    static void line(ostream& out, const string_view& name, const Histogram& latency){
+        out << "  " << name << string(name.size() < 12 ? 12 - name.size() : 1, ' ') << "count " << latency.count()
+            << ", mean " << duration(latency.mean()) << ", p50 " << duration(latency.percentile(0.5))
+            << ", p90 " << duration(latency.percentile(0.9)) << ", p99 " << duration(latency.percentile(0.99))
+            << ", max " << duration(latency.max_value()) << "\n";
+    }
+
+public:
+    void record_command(const string_view& name, const uint64_t& ns){
+        lock_guard<mutex> guard(lock);
+        auto found = commands.find(name);
+        if (found == commands.end()){
+            found = commands.emplace(string(name), Histogram()).first;
+        }
+        found->second.record(ns);
+    }
+
+    void record(const Operation& operation, const uint64_t& ns, const uint64_t& cells_written = 0){
+        lock_guard<mutex> guard(lock);
+        operations[operation].record(ns);
+        if (operation == Rasterize || operation == Rebuild || operation == Save || operation == Autosave){
+            cells[operation].record(cells_written);
+        }
+    }
+
+    void reset(){
+        lock_guard<mutex> guard(lock);
+        commands.clear();
+        for (int i = 0; i < OPERATIONS; i++){
+            operations[i] = Histogram();
+            cells[i] = Histogram();
+        }
+    }
+
+    void print(ostream& out) const {
+        static const char* const NAMES[OPERATIONS] = {"rasterize", "rebuild", "render", "undo", "redo", "freeze", "save", "autosave"};
+        lock_guard<mutex> guard(lock);
+        out << "Commands:\n";
+        for (auto& entry : commands){
+            line(out, entry.first, entry.second);
+        }
+        out << "Operations:\n";
+        for (int i = 0; i < OPERATIONS; i++){
+            if (operations[i].count() > 0) line(out, NAMES[i], operations[i]);
+        }
+        for (int i : {Rasterize, Rebuild, Save, Autosave}){
+            if (cells[i].count() == 0) continue;
+            out << "  " << NAMES[i] << (i == Save || i == Autosave ? " bytes" : " cells") << ": mean " << (uint64_t)cells[i].mean()
+                << ", p99 " << cells[i].percentile(0.99) << ", max " << cells[i].max_value() << "\n";
+        }
+    }
+};
+
+// Runs a fixed set of independent tasks on worker threads that live as long as the pool. Tasks are dealt round robin
+// into per-worker queues; a worker pops from the front of its own queue and, once that is empty, steals from the back
+// of the others. The threads are started by the first run and sleep between runs.
+class WorkPool{
+private:
+    struct Queue{
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    int workers;
+    vector<thread> threads;
+    unique_ptr<Queue[]> queues;
+    // One run at a time; `lock` hands it to the workers and `round` tells them a new one started.
+    mutex busy;
+    mutex lock;
+    condition_variable wake;
+    condition_variable finished;
+    function<void(const size_t&)> task;
+    int active = 0;
+    int running = 0;
+    uint64_t round = 0;
+    bool stopping = false;
+
+    static bool pop(Queue& queue, size_t& task, const bool& own){
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) return false;
+        if (own){
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        else {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+
+    void work(const int& self){
+        size_t next;
+        while (true){
+            bool found = pop(queues[self], next, true);
+            for (int k = 1; !found && k < active; k++){
+                found = pop(queues[(self + k) % active], next, false);
+            }
+            if (!found) return;
+            task(next);
+        }
+    }
+
+    void serve(const int& self){
+        uint64_t seen = 0;
+        unique_lock<mutex> guard(lock);
+        while (true){
+            wake.wait(guard, [&](){ return stopping || round != seen; });
+            if (stopping) return;
+            seen = round;
+            if (self >= active) continue;
+            guard.unlock();
+            work(self);
+            guard.lock();
+            if (--running == 0) finished.notify_one();
+        }
+    }
+
+    void start(){
+        if (!threads.empty()) return;
+        queues.reset(new Queue[workers]);
+        for (int i = 1; i < workers; i++){
+            threads.emplace_back(&WorkPool::serve, this, i);
+        }
+    }
+
+    void stop(){
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : threads){
+            worker.join();
+        }
+        threads.clear();
+        stopping = false;
+    }
+
+public:
+    WorkPool(const int& workers) : workers(max(1, workers)) {}
+
+    ~WorkPool(){
+        stop();
+    }
+
+    int size() const { return workers; }
+
+    void resize(const int& count){
+        lock_guard<mutex> guard(busy);
+        stop();
+        workers = max(1, count);
+    }
+
+    // Calls task(i) for every i below count and returns when all are done. The calling thread works too.
+    template <typename Task>
+    void run(const size_t& count, Task body){
+        int used = (int)min((size_t)workers, count);
+        if (used <= 1){
+            for (size_t i = 0; i < count; i++) body(i);
+            return;
+        }
+        lock_guard<mutex> serial(busy);
+        start();
+        for (size_t i = 0; i < count; i++){
+            queues[i % used].tasks.push_back(i);
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            task = [&](const size_t& i){ body(i); };
+            active = used;
+            running = used - 1;
+            round++;
+        }
+        wake.notify_all();
+        work(0);
+        unique_lock<mutex> guard(lock);
+        finished.wait(guard, [&](){ return running == 0; });
+        task = nullptr;
+    }
+};
+
+// Binary snapshot layout (native little-endian): header, figure records in z order, the extended colors they
+// use, then optionally the allocated tiles of the framebuffer.
+struct SnapshotHeader{
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    int32_t width;
+    int32_t height;
+    uint32_t figure_count;
+    int32_t next_id;
+};
+
+struct FigureRecord{
+    uint8_t kind;
+    uint8_t fill;
+    uint8_t color;
+    char symbol;
+    int32_t id;
+    int32_t params[4];
+};
+
+// Extended palette entry by the index it had when saved.
+struct PaletteRecord{
+    uint8_t index;
+    char name[15];
+};
+
+const char SNAPSHOT_MAGIC[4] = {'B', 'B', 'R', 'D'};
+const uint16_t SNAPSHOT_VERSION = 3;
+const uint16_t SNAPSHOT_RASTER = 1;
+
+// Figure of a snapshot or journal record; nullptr for an unknown shape kind.
+unique_ptr<Figure> build_figure(const int& kind, const bool& fill, const uint8_t& color, const int32_t* params, const int& figure_id){
+    switch (kind){
+    case SHAPE_SQUARE:
+        return make_unique<Figure>(Square(fill, color, params[0], params[1], params[2], figure_id));
+    case SHAPE_TRIANGLE:
+        return make_unique<Figure>(Triangle(fill, color, params[0], params[1], params[2], figure_id));
+    case SHAPE_CIRCLE:
+        return make_unique<Figure>(Circle(fill, color, params[0], params[1], params[2], figure_id));
+    case SHAPE_LINE:
+        return make_unique<Figure>(Line(color, params[0], params[1], params[2], params[3], figure_id));
+    }
+    return nullptr;
+}
+
+// Record of a figure as snapshots and the journal store it.
+FigureRecord to_record(const Figure& figure){
+    GeometryKey key = figure.key();
+    return {(uint8_t)key.kind, figure.is_filled(), figure.get_color(), figure.get_symbol(), figure.get_id(),
+            {key.params[0], key.params[1], key.params[2], key.params[3]}};
+}
+
+// One frozen version of the board. Readers draw, list and save from it without holding the board, while commands
+// go on changing the live one. The raster is left empty when it was not asked for while rasterization was deferred.
+struct BoardSnapshot{
+    int width;
+    int height;
+    Viewport view;
+    int next_id;
+    bool has_raster;
+    FrozenRaster raster;
+    shared_ptr<const FrozenFigures> figures;
+    // Keeps the extended colors the version uses from being handed out again.
+    Palette::Lease palette;
+};
+
+bool write_all(const int& target, const string_view& data){
+    size_t done = 0;
+    while (done < data.size()){
+        ssize_t count = write(target, data.data() + done, data.size() - done);
+        if (count == -1 && errno == EINTR) continue;
+        if (count == -1) return false;
+        done += count;
+    }
+    return true;
+}
+
+// A rename is only durable once the directory holding the file is synced.
+void sync_directory(const string& path){
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : path.substr(0, slash + 1);
+    int handle = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (handle != -1){
+        fsync(handle);
+        close(handle);
+    }
+}
+
+// Stream buffer that writes to a file descriptor in 64 KB pieces, so that a large file never has to be built in
+// memory first.
+class FileBuffer : public streambuf{
+private:
+    int handle;
+    char buffer[64 << 10];
+    size_t written = 0;
+    bool failed = false;
+
+    bool drain(){
+        size_t length = pptr() - pbase();
+        if (length > 0 && !failed){
+            failed = !write_all(handle, string_view(pbase(), length));
+            written += length;
+        }
+        setp(buffer, buffer + sizeof(buffer));
+        return !failed;
+    }
+protected:
+    int overflow(int c) override {
+        if (!drain()) return traits_type::eof();
+        if (c != traits_type::eof()){
+            *pptr() = c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override { return drain() ? 0 : -1; }
+public:
+    FileBuffer(const int& handle) : handle(handle) {
+        setp(buffer, buffer + sizeof(buffer));
+    }
+
+    size_t size() const { return written + (pptr() - pbase()); }
+    bool good() const { return !failed; }
+};
+
+// Replaces the file at `path` with what write(out) puts into the stream it is given, through a synced temporary
+// file and a rename, so that a crash leaves either the old file or the new one, never a torn mix of both.
+// `bytes` receives the size written.
+template <typename Write>
+bool replace_file(const string& path, Write write, size_t& bytes){
+    string temporary = path + ".tmp";
+    int handle = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (handle == -1) return false;
+    FileBuffer buffer(handle);
+    ostream out(&buffer);
+    write(out);
+    out.flush();
+    bytes = buffer.size();
+    bool written = buffer.good() && fdatasync(handle) == 0;
+    close(handle);
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0){
+        unlink(temporary.c_str());
+        return false;
+    }
+    sync_directory(path);
+    return true;
+}
+
+// Journal layout (native little-endian): header, then records, each the length and checksum of its payload and
+// the payload, a run of operations: a JournalOp byte followed by the operation's fields. The first record is a
+// base image of the board (its size, every extended color, every figure in z order); each later one holds the
+// figure changes of one command as they were applied, so selections, undo and redo replay without their history,
+// and the next figure id whenever a command used up ids without inserting figures, as rejected adds do.
+struct JournalHeader{
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+};
+
+struct JournalRecord{
+    uint32_t length;
+    uint32_t checksum;
+};
+
+// Empties the board and gives it a size.
+struct BoardRecord{
+    int32_t width;
+    int32_t height;
+    int32_t next_id;
+};
+
+struct InsertRecord{
+    FigureRecord figure;
+    uint64_t z;
+};
+
+struct RestyleRecord{
+    int32_t id;
+    uint8_t color;
+};
+
+enum JournalOp : uint8_t { JOURNAL_BOARD, JOURNAL_COLOR, JOURNAL_INSERT, JOURNAL_ERASE, JOURNAL_RESTYLE, JOURNAL_CLEAR,
+                           JOURNAL_NEXT_ID };
+
+const char JOURNAL_MAGIC[4] = {'B', 'B', 'J', 'L'};
+const uint16_t JOURNAL_VERSION = 1;
+
+// Append-only log of every change to the board, for recovery after a crash. A command adds its changes to an
+// open record and closes it when it finishes. A flusher thread writes whatever records have piled up and syncs
+// the file once for all of them, so commands finishing together share one sync. Once the journal outgrows its
+// limit the flusher compacts it: a base image of a recent version of the board goes to a temporary file, which
+// is renamed over the journal, and the records after that version are appended there.
+class CommandJournal{
+private:
+    // Compaction starts past this size, or past twice the last base image if that is bigger.
+    static const size_t COMPACT_BYTES = 4 << 20;
+
+    string path;
+    int fd = -1;
+    // Changes of the running command; only commands that change the board touch it.
+    string current;
+    // Extended colors already named in the file; later records only carry their index.
+    bool declared[256] = {};
+    // Next figure id as far as the records written in this process tell.
+    int32_t logged_id = 0;
+    bool failed = false;
+
+    mutex lock;
+    condition_variable wake;
+    condition_variable synced;
+    // Closed records not written yet, and counts of records closed and of records on disk.
+    string pending;
+    uint64_t closed = 0;
+    uint64_t durable = 0;
+    size_t file_bytes = 0;
+    size_t base_bytes = 0;
+    // Version to compact into, the records it covers and the bytes of `pending` those take up.
+    shared_ptr<const BoardSnapshot> base;
+    uint64_t base_covers = 0;
+    size_t base_pending = 0;
+    bool compacting = false;
+    bool stopping = false;
+    thread flusher;
+
+    static uint32_t checksum(const char* data, const size_t& length){
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < length; i++){
+            hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    template <typename Fields>
+    static void put(string& out, const JournalOp& op, const Fields& fields){
+        out += (char)op;
+        out.append((const char*)&fields, sizeof(fields));
+    }
+
+    static void frame(const string& payload, string& out){
+        JournalRecord record = {(uint32_t)payload.size(), checksum(payload.data(), payload.size())};
+        out.append((const char*)&record, sizeof(record));
+        out += payload;
+    }
+
+    static string header(){
+        JournalHeader header = {{JOURNAL_MAGIC[0], JOURNAL_MAGIC[1], JOURNAL_MAGIC[2], JOURNAL_MAGIC[3]}, JOURNAL_VERSION, 0};
+        return string((const char*)&header, sizeof(header));
+    }
+
+    static PaletteRecord palette_record(const uint8_t& index){
+        PaletteRecord entry = {index, {}};
+        Palette::instance().name(index).copy(entry.name, sizeof(entry.name) - 1);
+        return entry;
+    }
+
+    void declare(const uint8_t& color){
+        if (!Palette::is_named(color) && !declared[color]){
+            declared[color] = true;
+            put(current, JOURNAL_COLOR, palette_record(color));
+        }
+    }
+
+    void report(){
+        if (!failed){
+            failed = true;
+            console_error() << "Journal " << path << " could not be written: " << strerror(errno) << "\n";
+        }
+    }
+
+    // Writes a base image of `version` to a temporary file and renames it over the journal. Returns the size of the
+    // new journal, or 0 if it could not be written and the old one is kept.
+    size_t rewrite(const BoardSnapshot& version){
+        string payload;
+        put(payload, JOURNAL_BOARD, BoardRecord{version.width, version.height, version.next_id});
+        // Nothing is freed while the version's lease is held, so the colors the records after it name are all here.
+        Palette::instance().for_each_extended([&](const uint8_t& index, const string& name){
+            PaletteRecord entry = {index, {}};
+            name.copy(entry.name, sizeof(entry.name) - 1);
+            put(payload, JOURNAL_COLOR, entry);
+        });
+        version.figures->for_each([&](const Figure& figure){
+            put(payload, JOURNAL_INSERT, InsertRecord{to_record(figure), figure.z});
+        });
+        string image = header();
+        frame(payload, image);
+
+        string temporary = path + ".tmp";
+        int handle = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (handle == -1){
+            report();
+            return 0;
+        }
+        if (!write_all(handle, image) || fdatasync(handle) != 0 || rename(temporary.c_str(), path.c_str()) != 0){
+            report();
+            close(handle);
+            unlink(temporary.c_str());
+            return 0;
+        }
+        sync_directory(path);
+        close(fd);
+        fd = handle;
+        return image.size();
+    }
+
+    void flush_loop(){
+        unique_lock<mutex> guard(lock);
+        while (true){
+            wake.wait(guard, [&](){ return stopping || base || !pending.empty(); });
+            if (base){
+                shared_ptr<const BoardSnapshot> version = move(base);
+                guard.unlock();
+                size_t written = rewrite(*version);
+                guard.lock();
+                // The records the image covers never need to reach the file.
+                if (written){
+                    pending.erase(0, base_pending);
+                    file_bytes = base_bytes = written;
+                    durable = max(durable, base_covers);
+                    synced.notify_all();
+                }
+                compacting = false;
+                continue;
+            }
+            if (pending.empty()) break;
+
+            string batch;
+            batch.swap(pending);
+            uint64_t upto = closed;
+            guard.unlock();
+            if (!write_all(fd, batch) || fdatasync(fd) != 0) report();
+            guard.lock();
+            file_bytes += batch.size();
+            durable = max(durable, upto);
+            synced.notify_all();
+        }
+    }
+public:
+    CommandJournal() = default;
+    CommandJournal(const CommandJournal&) = delete;
+    CommandJournal& operator=(const CommandJournal&) = delete;
+
+    ~CommandJournal(){
+        if (flusher.joinable()){
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            flusher.join();
+        }
+        if (fd != -1) close(fd);
+    }
+
+    // Opens the journal at `journal_path`, creating it if needed, and hands the payload of every intact record to
+    // replay(), oldest first. The first record replay() refuses and everything after it are cut off, as is a torn
+    // record a crash left behind. False if the file cannot be used as a journal.
+    template <typename Replay>
+    bool open(const string& journal_path, Replay replay){
+        path = journal_path;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat info;
+        if (fd == -1 || fstat(fd, &info) != 0){
+            console_error() << "Unable to open journal " << path << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        string data(info.st_size, '\0');
+        for (size_t done = 0; done < data.size();){
+            ssize_t count = pread(fd, &data[done], data.size() - done, done);
+            if (count == -1 && errno == EINTR) continue;
+            if (count <= 0){
+                data.resize(done);
+                break;
+            }
+            done += count;
+        }
+
+        size_t end = sizeof(JournalHeader);
+        if (data.empty()){
+            if (!write_all(fd, header()) || fdatasync(fd) != 0){
+                console_error() << "Unable to write journal " << path << ": " << strerror(errno) << "\n";
+                return false;
+            }
+            sync_directory(path);
+        }
+        else{
+            JournalHeader found;
+            if (data.size() < sizeof(found) || (memcpy(&found, data.data(), sizeof(found)), memcmp(found.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0)
+                || found.version != JOURNAL_VERSION){
+                console_error() << path << " is not a journal\n";
+                return false;
+            }
+            while (end + sizeof(JournalRecord) <= data.size()){
+                JournalRecord record;
+                memcpy(&record, data.data() + end, sizeof(record));
+                const char* payload = data.data() + end + sizeof(record);
+                if (record.length > data.size() - end - sizeof(record) || checksum(payload, record.length) != record.checksum
+                    || !replay(payload, (size_t)record.length)){
+                    break;
+                }
+                end += sizeof(record) + record.length;
+                if (base_bytes == 0) base_bytes = end;
+            }
+            if (end < data.size()){
+                console_error() << "Journal " << path << ": dropped " << data.size() - end << " bytes after the last intact record\n";
+                if (ftruncate(fd, end) != 0 || fdatasync(fd) != 0){
+                    console_error() << "Unable to write journal " << path << ": " << strerror(errno) << "\n";
+                    return false;
+                }
+            }
+        }
+        lseek(fd, end, SEEK_SET);
+        file_bytes = end;
+        flusher = thread(&CommandJournal::flush_loop, this);
+        return true;
+    }
+
+    // Whether the file holds nothing but its header, not even a base image.
+    bool empty() const { return base_bytes == 0; }
+
+    void insert(const Figure& figure){
+        InsertRecord record = {to_record(figure), figure.z};
+        declare(record.figure.color);
+        put(current, JOURNAL_INSERT, record);
+        logged_id = max(logged_id, record.figure.id + 1);
+    }
+
+    void erase(const int& id){
+        put(current, JOURNAL_ERASE, (int32_t)id);
+    }
+
+    void restyle(const int& id, const uint8_t& color){
+        RestyleRecord record = {};
+        record.id = id;
+        record.color = color;
+        declare(color);
+        put(current, JOURNAL_RESTYLE, record);
+    }
+
+    // Extended colors are named again after a clear, as the board may have given their indices to others.
+    void clear(){
+        current += (char)JOURNAL_CLEAR;
+        fill(begin(declared), end(declared), false);
+    }
+
+    void board(const int& width, const int& height, const int& next_id){
+        put(current, JOURNAL_BOARD, BoardRecord{width, height, next_id});
+        logged_id = max(logged_id, next_id);
+    }
+
+    // Records the next figure id if it moved past what the records so far imply.
+    void next_id(const int& id){
+        if (id > logged_id){
+            put(current, JOURNAL_NEXT_ID, (int32_t)id);
+            logged_id = id;
+        }
+    }
+
+    // Closes the running command's record, if it changed anything. Returns the number of records closed so far,
+    // for wait().
+    uint64_t commit(){
+        lock_guard<mutex> guard(lock);
+        if (!current.empty()){
+            frame(current, pending);
+            current.clear();
+            closed++;
+            wake.notify_one();
+        }
+        return closed;
+    }
+
+    // Blocks until the first `ticket` records are on disk.
+    void wait(const uint64_t& ticket){
+        unique_lock<mutex> guard(lock);
+        synced.wait(guard, [&](){ return durable >= ticket; });
+    }
+
+    bool wants_compaction(){
+        lock_guard<mutex> guard(lock);
+        return !compacting && file_bytes + pending.size() > max((size_t)COMPACT_BYTES, 2 * base_bytes);
+    }
+
+    // Hands the flusher a version of the board that includes every record closed so far.
+    void compact(shared_ptr<const BoardSnapshot> version){
+        lock_guard<mutex> guard(lock);
+        base = move(version);
+        base_covers = closed;
+        base_pending = pending.size();
+        compacting = true;
+        wake.notify_one();
+    }
+};
+
+class Blackboard
+{
+private:
+    // Boards up to this size are drawn whole; bigger ones through a viewport of this size.
+    static constexpr int VIEW_WIDTH = 200;
+    static constexpr int VIEW_HEIGHT = 100;
+    // Full rebuilds of smaller boards are not worth starting threads for.
+    static const size_t PARALLEL_FIGURES = 512;
+
+    int width;
+    int height;
+    Viewport view;
+
+    Framebuffer framebuffer;
+    Renderer renderer;
+    FigureTable figures;
+    SpatialIndex index;
+    uint64_t next_z = 0;
+    History history;
+    Command pending;
+    bool deferred = false;
+    bool stale = false;
+    long generation = 0;
+    WorkPool pool;
+    Stats stats;
+    // Last version handed out by snapshot(). The figure list is copied again only after figures changed.
+    mutex freeze_lock;
+    shared_ptr<const BoardSnapshot> frozen;
+    FrozenFigures figure_chunks;
+    shared_ptr<const FrozenFigures> frozen_figures;
+    bool figures_thawed = true;
+    // Where every change is logged once the board has been recovered from it.
+    CommandJournal* journal = nullptr;
+
+    // Runs body() and records its latency, and for rasterizations the cells it wrote, under `operation`.
+    template <typename Body>
+    void timed(const Stats::Operation& operation, Body body){
+        uint64_t written = framebuffer.cells_written();
+        auto start = chrono::steady_clock::now();
+        body();
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        stats.record(operation, elapsed, framebuffer.cells_written() - written);
+    }
+
+    // Splits the board into bands of whole tile rows, bins every figure into the bands its bounds cross and
+    // rasterizes the bands on the pool, each into a private framebuffer clipped to the band. Every band sees its
+    // figures in z order, so the result is identical to the serial pass.
+    void rasterize_parallel(){
+        int tile_rows = (height + TILE_SIZE - 1) >> TILE_SHIFT;
+        int band_rows = ((tile_rows + pool.size() * 4 - 1) / (pool.size() * 4)) << TILE_SHIFT;
+        int bands = (height + band_rows - 1) / band_rows;
+
+        vector<vector<Figure*>> binned(bands);
+        Rect board = {0, 0, width - 1, height - 1};
+        figures.for_each([&](Figure* figure){
+            Rect box = figure->bounds().intersect(board);
+            if (box.empty()) return;
+            for (int band = (height - 1 - box.y1) / band_rows; band <= (height - 1 - box.y0) / band_rows; band++){
+                binned[band].push_back(figure);
+            }
+        });
+
+        vector<Framebuffer> parts;
+        parts.reserve(bands);
+        for (int band = 0; band < bands; band++){
+            parts.emplace_back(width, height);
+        }
+        pool.run(bands, [&](const size_t& band){
+            parts[band].set_clip(0, band * band_rows, width - 1, (band + 1) * band_rows - 1);
+            for (Figure* figure : binned[band]){
+                figure->rasterize(&parts[band]);
+            }
+        });
+        for (auto& part : parts){
+            framebuffer.absorb(part);
+        }
+    }
+
+    // Brings the framebuffer up to date after deferred commands by rasterizing every figure in z order.
+    void ensure_raster(){
+        if (!stale) return;
+        timed(Stats::Rebuild, [&](){
+            framebuffer.clear();
+            if (pool.size() > 1 && figures.size() >= PARALLEL_FIGURES){
+                rasterize_parallel();
+            }
+            else figures.for_each([&](Figure* figure){
+                figure->add(&framebuffer);
+            });
+        });
+        stale = false;
+    }
+
+    // Cell records are only replayed against the plane they were taken from. A rebuild draws the same plane, so
+    // after a command without cells the board is rebuilt once and the records of the commands before it stay
+    // good; only while rasterization is deferred are they dropped, and the plane is rebuilt from the figures later.
+    void step(Command& command, const bool& forward){
+        bool cells_valid = command.generation == generation;
+        if (cells_valid && stale && !deferred){
+            ensure_raster();
+        }
+        if (!cells_valid || stale){
+            command.cells.clear();
+            command.generation = -1;
+            stale = true;
+        }
+
+        if (forward){
+            for (auto& change : command.cells.spans){
+                framebuffer.swap(command.cells, change);
+            }
+            for (auto& change : command.figures){
+                apply(change);
+            }
+        }
+        else{
+            for (auto it = command.figures.rbegin(); it != command.figures.rend(); ++it){
+                revert(*it);
+            }
+            for (auto it = command.cells.spans.rbegin(); it != command.cells.spans.rend(); ++it){
+                framebuffer.swap(command.cells, *it);
+            }
+        }
+    }
+
+    void apply(FigureChange& change){
+        figures_thawed = true;
+        if (journal){
+            if (change.kind == FigureChange::Insert) journal->insert(*change.held);
+            else if (change.kind == FigureChange::Erase) journal->erase(change.figure_id);
+            else journal->restyle(change.figure_id, change.color);
+        }
+        switch (change.kind){
+        case FigureChange::Insert:
+            index.insert(change.held.get());
+            figures.place(move(change.held));
+            break;
+        case FigureChange::Erase:
+            change.held = figures.take(change.figure_id);
+            index.erase(change.held.get());
+            break;
+        case FigureChange::Restyle: {
+            Figure* figure = figures.modify(change.figure_id);
+            uint8_t current = figure->get_color();
+            figure->set_color(change.color);
+            change.color = current;
+            break;
+        }
+        }
+    }
+
+    void revert(FigureChange& change){
+        if (change.kind == FigureChange::Insert){
+            change.kind = FigureChange::Erase;
+            apply(change);
+            change.kind = FigureChange::Insert;
+        }
+        else if (change.kind == FigureChange::Erase){
+            change.kind = FigureChange::Insert;
+            apply(change);
+            change.kind = FigureChange::Erase;
+        }
+        else apply(change);
+    }
+
+    void perform(FigureChange::Kind kind, const int& figure_id, unique_ptr<Figure> figure = nullptr, const uint8_t& color = 0){
+        if (kind == FigureChange::Insert){
+            figure->z = next_z++;
+        }
+        pending.figures.push_back({kind, figure_id, move(figure), color});
+        apply(pending.figures.back());
+    }
+
+    void begin_command(){
+        pending = Command();
+        if (!deferred){
+            ensure_raster();
+            framebuffer.set_journal(&pending.cells);
+        }
+    }
+
+    void commit_command(){
+        framebuffer.set_journal(nullptr);
+        // Commands that left the board to be rebuilt have no cells to replay.
+        if (!deferred && !stale){
+            pending.generation = generation;
+        }
+        else stale = true;
+        if (!pending.empty()){
+            history.push(move(pending));
+        }
+    }
+
+    // Cells the figures cover, as spans sorted by row and column that do not overlap.
+    template <typename Figures>
+    vector<RowSpan> footprint(const Figures& changed){
+        vector<RowSpan> spans;
+        framebuffer.set_collect(&spans);
+        for (auto& figure : changed){
+            figure->add(&framebuffer);
+        }
+        framebuffer.set_collect(nullptr);
+        if (spans.empty()){
+            return spans;
+        }
+
+        sort(spans.begin(), spans.end(), [](const RowSpan& a, const RowSpan& b){
+            return a.row < b.row || (a.row == b.row && a.first < b.first);
+        });
+        size_t merged = 0;
+        for (size_t i = 1; i < spans.size(); i++){
+            if (spans[i].row == spans[merged].row && spans[i].first <= spans[merged].last + 1){
+                spans[merged].last = max(spans[merged].last, spans[i].last);
+            }
+            else spans[++merged] = spans[i];
+        }
+        spans.resize(merged + 1);
+        return spans;
+    }
+
+    // Redraws the cells a changed figure covered or covers now: they are blanked, then every figure whose box meets
+    // one of them is rasterized again in z order, masked to those cells. This costs the footprints and the figures
+    // around them, not the area of their boxes. Runs inside a command, so the journal covers it.
+    void recompose(const vector<Figure*>& changed){
+        if (deferred){
+            return;
+        }
+        timed(Stats::Rasterize, [&](){
+            vector<RowSpan> spans = footprint(changed);
+            if (spans.empty()){
+                return;
+            }
+
+            vector<Figure*> covering;
+            int first_col = INT_MAX, last_col = INT_MIN;
+            for (auto& span : spans){
+                framebuffer.clear_span(span.row, span.first, span.last);
+                int y = height - 1 - span.row;
+                vector<Figure*> found = index.query({span.first, y, span.last, y});
+                covering.insert(covering.end(), found.begin(), found.end());
+                first_col = min(first_col, span.first);
+                last_col = max(last_col, span.last);
+            }
+            sort(covering.begin(), covering.end());
+            covering.erase(unique(covering.begin(), covering.end()), covering.end());
+            sort(covering.begin(), covering.end(), [](const Figure* a, const Figure* b){ return a->z < b->z; });
+
+            framebuffer.set_clip(first_col, spans.front().row, last_col, spans.back().row);
+            framebuffer.set_mask(&spans);
+            for (Figure* figure : covering){
+                figure->add(&framebuffer);
+            }
+            framebuffer.set_mask(nullptr);
+            framebuffer.reset_clip();
+        });
+    }
+
+    template <typename Fields>
+    static bool take(const char*& data, const char* end, Fields& fields){
+        if (end - data < (ptrdiff_t)sizeof(fields)) return false;
+        memcpy(&fields, data, sizeof(fields));
+        data += sizeof(fields);
+        return true;
+    }
+
+    // Clears the board but keeps every palette color, for callers that still hold figures or fill the board again.
+    void empty(){
+        if (journal){
+            journal->clear();
+        }
+        // When the board and its history hold every figure in the pool, the pool is rewound and they are all
+        // dropped at once; otherwise, as while a load still holds the figures it read or a session the figures of
+        // its batch, they go one by one.
+        bool abandon = FigurePool::instance().reset(owned_figures());
+        figures.clear(abandon);
+        figures_thawed = true;
+        framebuffer.clear();
+        index.clear();
+        history.clear(abandon);
+        stale = false;
+    }
+
+    // Figures the board owns: those on it and those its history holds off it. Counting one twice could rewind the
+    // pool under a figure held elsewhere, so builds with assertions check that they are all distinct.
+    size_t owned_figures() const {
+        size_t count = figures.size();
+        history.for_each_held([&](const Figure*){ count++; });
+        assert(count == [&](){
+            unordered_set<const Figure*> distinct;
+            figures.for_each([&](const Figure* figure){ distinct.insert(figure); });
+            history.for_each_held([&](const Figure* figure){ distinct.insert(figure); });
+            return distinct.size();
+        }());
+        return count;
+    }
+
+    // Gives the palette back the extended colors that neither the board nor its history uses. Run after the board
+    // was emptied or replaced, when most of them are likely to have gone.
+    void release_colors(){
+        bool used[256] = {};
+        figures.for_each([&](Figure* figure){ used[figure->get_color()] = true; });
+        history.colors(used);
+        // The cached version holds a lease, and what it shows is gone anyway.
+        frozen.reset();
+        if (Palette::instance().release(used)){
+            // Freed indices are drawn in other colors once handed out again, so the next frame repaints every cell.
+            renderer.set_live(renderer.is_live());
+        }
+    }
+
+    // Empties the board during replay through erase changes, so that it can be filled again by reverting them.
+    void erase_all(vector<FigureChange>& applied){
+        vector<int> ids;
+        ids.reserve(figures.size());
+        figures.for_each([&](Figure* figure){ ids.push_back(figure->get_id()); });
+        for (int id : ids){
+            applied.push_back({FigureChange::Erase, id, nullptr, 0});
+            apply(applied.back());
+        }
+    }
+
+    // Applies one journal record, bypassing history; `colors` maps the journal's extended colors to this
+    // process's palette. A record applies whole or not at all: if any of its operations is malformed or does not
+    // fit the board, the ones before it are undone and false is returned, so the board stays where the previous
+    // record left it, which is where the journal gets cut.
+    bool replay(const char* data, const size_t& length, uint8_t* colors){
+        vector<FigureChange> applied;
+        // Sizes the record replaced, each with the number of changes applied before it.
+        vector<pair<size_t, pair<int, int>>> resized;
+        int first_id = Shape::id;
+        uint64_t first_z = next_z;
+        bool emptied = false;
+        if (replay_ops(data, length, colors, applied, resized, emptied)){
+            // Only once the record stands, as undoing it would bring back the figures it erased.
+            if (emptied) release_colors();
+            return true;
+        }
+
+        for (size_t i = applied.size(); ; i--){
+            while (!resized.empty() && resized.back().first == i){
+                resize(resized.back().second.first, resized.back().second.second);
+                resized.pop_back();
+            }
+            if (i == 0) break;
+            revert(applied[i - 1]);
+        }
+        Shape::id = first_id;
+        next_z = first_z;
+        return false;
+    }
+
+    bool replay_ops(const char* data, const size_t& length, uint8_t* colors, vector<FigureChange>& applied,
+                    vector<pair<size_t, pair<int, int>>>& resized, bool& emptied){
+        const char* end = data + length;
+        while (data < end){
+            switch (*data++){
+            case JOURNAL_BOARD: {
+                BoardRecord board;
+                if (!take(data, end, board) || !valid_board(board.width, board.height)) return false;
+                erase_all(applied);
+                emptied = true;
+                if (board.width != width || board.height != height){
+                    resized.push_back({applied.size(), {width, height}});
+                    resize(board.width, board.height);
+                }
+                Shape::id = max(Shape::id, board.next_id);
+                break;
+            }
+            case JOURNAL_COLOR: {
+                PaletteRecord entry;
+                if (!take(data, end, entry) || Palette::is_named(entry.index)) return false;
+                if (!Palette::instance().resolve(string_view(entry.name, strnlen(entry.name, sizeof(entry.name))), colors[entry.index])) return false;
+                break;
+            }
+            case JOURNAL_INSERT: {
+                InsertRecord record;
+                if (!take(data, end, record) || colors[record.figure.color] == 0 || !valid_params(record.figure.kind, record.figure.params)
+                    || record.figure.id < 0) return false;
+                auto figure = build_figure(record.figure.kind, record.figure.fill != 0, colors[record.figure.color], record.figure.params, record.figure.id);
+                if (!figure || figure->place(width, height) || index.find(figure->key()) != nullptr || figures.get(figure->get_id()) != nullptr){
+                    return false;
+                }
+                figure->z = record.z;
+                next_z = max(next_z, record.z + 1);
+                Shape::id = max(Shape::id, figure->get_id() + 1);
+                int id = figure->get_id();
+                applied.push_back({FigureChange::Insert, id, move(figure), 0});
+                apply(applied.back());
+                break;
+            }
+            case JOURNAL_ERASE: {
+                int32_t id;
+                if (!take(data, end, id) || figures.get(id) == nullptr) return false;
+                applied.push_back({FigureChange::Erase, id, nullptr, 0});
+                apply(applied.back());
+                break;
+            }
+            case JOURNAL_RESTYLE: {
+                RestyleRecord record;
+                if (!take(data, end, record) || figures.get(record.id) == nullptr || colors[record.color] == 0) return false;
+                applied.push_back({FigureChange::Restyle, record.id, nullptr, colors[record.color]});
+                apply(applied.back());
+                break;
+            }
+            case JOURNAL_CLEAR:
+                erase_all(applied);
+                emptied = true;
+                break;
+            case JOURNAL_NEXT_ID: {
+                int32_t next_id;
+                if (!take(data, end, next_id) || next_id < 0) return false;
+                Shape::id = max(Shape::id, next_id);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    Blackboard(const int& width = 90, const int& height = 50, const size_t& history_limit = 64 << 20) : width(width), height(height),
+        view{0, 0, min(width, VIEW_WIDTH), min(height, VIEW_HEIGHT)}, framebuffer(width, height), index(width, height), history(history_limit),
+        pool(thread::hardware_concurrency()) {}
+
+
+    void draw() {
+        ensure_raster();
+        timed(Stats::Render, [&](){ renderer.render(framebuffer, view); });
+    }
+
+    // Rebuilds the board from the journal at `path`, then logs every change to it. A journal without a base image
+    // gets one of the board as it is.
+    bool recover(CommandJournal& target, const string& path){
+        uint8_t colors[256] = {};
+        for (uint8_t i = 1; i < NAMED_COUNT; i++){
+            colors[i] = i;
+        }
+        size_t records = 0;
+        bool opened = target.open(path, [&](const char* data, const size_t& length){
+            if (!replay(data, length, colors)) return false;
+            records++;
+            return true;
+        });
+        history.clear(false);
+        stale = true;
+        if (!deferred){
+            ensure_raster();
+        }
+        if (!opened) return false;
+
+        journal = &target;
+        if (journal->empty()) journal->compact(snapshot(false));
+        if (records > 0) console_error() << "Replayed " << records << " journal records from " << path << "\n";
+        return true;
+    }
+
+    // Closes the journal record of the command that just ran and starts a compaction once the journal has grown
+    // too big. Returns the ticket sync_journal() waits on until the record is on disk.
+    uint64_t log_command(){
+        if (!journal) return 0;
+        journal->next_id(Shape::id);
+        uint64_t ticket = journal->commit();
+        if (journal->wants_compaction()){
+            journal->compact(snapshot(false));
+        }
+        return ticket;
+    }
+
+    void sync_journal(const uint64_t& ticket){
+        if (journal && ticket) journal->wait(ticket);
+    }
+
+    // Draws a frozen version; touches nothing of the live board, so commands may run meanwhile.
+    void draw(const BoardSnapshot& version) {
+        auto start = chrono::steady_clock::now();
+        renderer.render(version.raster, version.view);
+        stats.record(Stats::Render, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+
+    // The board as it is now, frozen. Versions are cached until the board changes, and a new one only copies
+    // what changed since the last: the tiles written since, and the figure list if figures changed.
+    // Concurrent readers may call it as long as no command runs.
+    shared_ptr<const BoardSnapshot> snapshot(const bool& with_raster = true){
+        if (with_raster){
+            ensure_raster();
+        }
+        lock_guard<mutex> guard(freeze_lock);
+        if (frozen && !figures_thawed && !framebuffer.has_thawed() && frozen->view == view && frozen->next_id == Shape::id
+            && (frozen->has_raster || stale)){
+            return frozen;
+        }
+        auto start = chrono::steady_clock::now();
+        if (figures_thawed){
+            figures.freeze(figure_chunks);
+            frozen_figures = make_shared<const FrozenFigures>(figure_chunks);
+            figures_thawed = false;
+        }
+        // A stale framebuffer is not worth freezing; the version goes without a raster.
+        FrozenRaster raster = stale ? FrozenRaster() : framebuffer.freeze();
+        frozen = make_shared<const BoardSnapshot>(BoardSnapshot{width, height, view, Shape::id, !stale, move(raster),
+                                                                frozen_figures, Palette::Lease()});
+        stats.record(Stats::Freeze, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        return frozen;
+    }
+
+    void refresh() {
+        if (renderer.is_live()){
+            ensure_raster();
+            timed(Stats::Render, [&](){ renderer.update(framebuffer, view); });
+        }
+    }
+
+    // Moves the drawn window; x and y are the top left corner in board coordinates.
+    void set_view(const int& x, const int& y, const int& view_width, const int& view_height){
+        int col = max(0, min(x, width - 1));
+        int row = max(0, min(height - 1 - y, height - 1));
+        view = {col, row, max(1, min(view_width, width - col)), max(1, min(view_height, height - row))};
+    }
+
+    void reset_view(){
+        view = {0, 0, min(width, VIEW_WIDTH), min(height, VIEW_HEIGHT)};
+    }
+
+    // Starts an empty board of a new size.
+    void resize(const int& new_width, const int& new_height){
+        empty();
+        width = new_width;
+        height = new_height;
+        framebuffer = Framebuffer(width, height);
+        index = SpatialIndex(width, height);
+        reset_view();
+        renderer.set_live(renderer.is_live());
+    }
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+
+    // Replaces the board with already constructed figures in z order, bypassing history.
+    // With saved tiles the framebuffer is copied as is, otherwise it is rebuilt from the figures.
+    // Nothing is touched unless every figure fits the new board and none is a duplicate, so a file that is refused
+    // leaves the board as it was.
+    bool restore(const int& new_width, const int& new_height, vector<unique_ptr<Figure>>& loaded, const char* tiles = nullptr, const uint32_t& tile_count = 0){
+        unordered_set<GeometryKey, GeometryHash> seen;
+        seen.reserve(loaded.size());
+        for (auto& figure : loaded){
+            if (figure->place(new_width, new_height) || !seen.insert(figure->key()).second){
+                return false;
+            }
+        }
+
+        if (new_width != width || new_height != height){
+            resize(new_width, new_height);
+        }
+        else empty();
+        if (journal){
+            journal->board(width, height, Shape::id);
+        }
+        for (auto& figure : loaded){
+            figure->z = next_z++;
+            figures_thawed = true;
+            Shape::id = max(Shape::id, figure->get_id() + 1);
+            if (journal){
+                journal->insert(*figure);
+            }
+            index.insert(figure.get());
+            figures.place(move(figure));
+        }
+        if (tiles != nullptr){
+            framebuffer.load_tiles(tiles, tile_count);
+            generation++;
+        }
+        else stale = true;
+        release_colors();
+        if (!deferred){
+            ensure_raster();
+        }
+        return true;
+    }
+
+    // While deferred, commands only update figures and the index; the board is rasterized once on the next draw
+    // or when deferral ends.
+    void set_deferred(const bool& enabled){
+        deferred = enabled;
+        if (!deferred){
+            ensure_raster();
+        }
+    }
+
+    bool is_live() const {
+        return renderer.is_live();
+    }
+
+    // Threads used for full rebuilds of the board; 1 keeps rasterization on the calling thread.
+    void set_threads(const int& count){
+        pool.resize(count);
+    }
+
+    void set_live(const bool& enabled){
+        renderer.set_live(enabled);
+        if (enabled){
+            renderer.render(framebuffer, view);
+        }
+    }
+
+    // Rejects duplicates and figures outside the board, then records the insert.
+    void add(unique_ptr<Figure> new_figure){
+        if (index.find(new_figure->key()) != nullptr) {
+            console() << "Same figure exists\n";
+            return;
+        }
+        if (new_figure->place(width, height)){
+            console() << "Figure is outside the box\n";
+            return;
+        }
+        begin_command();
+        if (!deferred){
+            timed(Stats::Rasterize, [&](){ new_figure->add(&framebuffer); });
+        }
+
+        int id = new_figure->get_id();
+        perform(FigureChange::Insert, id, move(new_figure));
+        commit_command();
+    }
+
+    // Adds a batch as one command, so one undo step and one journal record: every figure, or none if any of them
+    // is outside the board or a duplicate, of the board or within the batch. A batch at least as big as the board
+    // it lands on is rasterized by one rebuild rather than figure by figure.
+    bool add_all(vector<unique_ptr<Figure>>& batch){
+        if (batch.empty()) return true;
+        unordered_set<GeometryKey, GeometryHash> seen;
+        seen.reserve(batch.size());
+        for (auto& figure : batch){
+            if (figure->place(width, height)){
+                console() << "Figure is outside the box: " << figure->describe();
+                return false;
+            }
+            if (index.find(figure->key()) != nullptr || !seen.insert(figure->key()).second){
+                console() << "Same figure exists: " << figure->describe();
+                return false;
+            }
+        }
+
+        bool rebuild = !deferred && batch.size() >= figures.size();
+        begin_command();
+        if (!deferred){
+            timed(Stats::Rasterize, [&](){
+                // The rebuild is not journaled, so the cells under the batch are saved before it. The batch lands on
+                // top of every other figure, so nothing else changes, and undo swaps them back like any command.
+                if (rebuild) framebuffer.save_spans(footprint(batch));
+                else for (auto& figure : batch) figure->add(&framebuffer);
+            });
+        }
+        if (rebuild){
+            framebuffer.set_journal(nullptr);
+            stale = true;
+        }
+        for (auto& figure : batch){
+            int id = figure->get_id();
+            perform(FigureChange::Insert, id, move(figure));
+        }
+        if (rebuild){
+            ensure_raster();
+        }
+        commit_command();
+        return true;
+    }
+
+    void shapes() {
+        console() << MAGENTA << "Square:" << YELLOW << " size, coordinates" << BLUE << "[x,y]" << RESET << " of top left edge\n";
+        console() << MAGENTA << "Circle:" << YELLOW << " radius, coordinates" << BLUE << "[x,y]" << RESET << " of centre\n";
+        console() << MAGENTA << "Triangle:" << YELLOW << " height, coordinates" << BLUE << "[x,y]" << RESET << " of upmost edge\n";
+        console() << MAGENTA << "Line:" << YELLOW << " length, angle, coordinates" << BLUE << "[x,y]" << RESET << " of starting point\n";
+    };
+
+    const vector<string> list(){
+        vector<string> figures_info;
+        if(figures.size() > 0){
+            figures.for_each([&](Figure* shape){
+                figures_info.push_back(shape->get_info());
+            });
+        }
+        else console() << " No figures on board\n";
+
+        return figures_info;        
+    }
+
+    static const vector<string> list(const BoardSnapshot& version){
+        vector<string> figures_info;
+        if (!version.figures->empty()){
+            version.figures->for_each([&](const Figure& figure){
+                figures_info.push_back(figure.get_info());
+            });
+        }
+        else console() << " No figures on board\n";
+
+        return figures_info;
+    }
+
+    void undo(const int& steps = 1){
+        if (!history.can_undo()){
+            console() << "Nothing to undo\n";
+            return;
+        }
+        timed(Stats::Undo, [&](){
+            for (int i = 0; i < steps && history.can_undo(); i++){
+                step(history.last_done(), false);
+                history.step_back();
+            }
+        });
+        if (!deferred){
+            ensure_raster();
+        }
+    }
+
+    void redo(const int& steps = 1){
+        if (!history.can_redo()){
+            console() << "Nothing to redo\n";
+            return;
+        }
+        timed(Stats::Redo, [&](){
+            for (int i = 0; i < steps && history.can_redo(); i++){
+                step(history.last_undone(), true);
+                history.step_forward();
+            }
+        });
+        if (!deferred){
+            ensure_raster();
+        }
+    }
+
+    Stats& get_stats() {
+        return stats;
+    }
+
+    // Latency report followed by what the board currently holds.
+    void print_stats(ostream& out){
+        stats.print(out);
+        size_t tiles = framebuffer.tile_count();
+        out << "Board: " << width << "x" << height << ", " << figures.size() << " figures, " << tiles << " tiles ("
+            << tiles * TILE_CELLS << " cells) using " << framebuffer.bytes() / 1024 << " KB, "
+            << framebuffer.cells_written() << " cells written\n";
+        out << "History: " << history.undo_steps() << " undo and " << history.redo_steps() << " redo steps using "
+            << history.get_bytes() / 1024 << " KB of " << history.get_limit() / 1024 << " KB\n";
+    }
+
+    void history_info(){
+        console() << "Undo steps: " << history.undo_steps() << ", redo steps: " << history.redo_steps()
+             << ", memory: " << history.get_bytes() / 1024 << " KB of " << history.get_limit() / 1024 << " KB\n";
+    }
+
+    void set_history_limit(const size_t& bytes){
+        history.set_limit(bytes);
+    }
+
+    void clear(){
+        empty();
+        release_colors();
+    }
+
+    // Selections belong to whoever issued the command, so selecting only reads the board.
+    void select_figure_by_coord(const int& x, const int& y, int& selected_id) const {
+        Figure* figure = nullptr;
+
+        if (x >= 0 && x < width && y >= 0 && y < height){
+            figure = index.hit(x, y);
+        }
+
+        if (figure != nullptr){
+            selected_id = figure->get_id();
+            console() << "Selected ";
+            figure->get_info();
+        }
+        else{
+            console() << "There is no figure on coordinates\n";
+        }
+    }
+
+    void select_by_id(const int& id, int& selected_id) const {
+        Figure* shape = figures.get(id);
+        if (shape != nullptr){
+            selected_id = id;
+            console() << "Selected: ";
+            shape->get_info();
+        }
+        else console() << "No figures with that id\n";
+    }
+
+    void remove(int& selected_id){
+        Figure* figure = figures.get(selected_id);
+        if (figure == nullptr){
+            console() << "No figure selected\n";
+            return;
+        }
+        figure->get_info();
+        begin_command();
+        perform(FigureChange::Erase, selected_id);
+        recompose({pending.figures.back().held.get()});
+        commit_command();
+        selected_id = -1;
+        console() << "Was removed\n";
+    }
+
+    void edit(const int& selected_id, const int& size){
+        Figure* selected = figures.get(selected_id);
+        if (selected == nullptr){
+            console() << "No figure selected\n";
+            return;
+        }
+        auto new_figure = selected->resized(size);
+        Figure* existing = index.find(new_figure->key());
+
+        if (existing != nullptr && existing != selected){
+            console() << "Same figure exists\n";
+            return;
+        }
+        if (new_figure->place(width, height)){
+            console() << "Figure is outside the box\n";
+            return;
+        }
+        begin_command();
+        perform(FigureChange::Erase, selected_id);
+        perform(FigureChange::Insert, selected_id, move(new_figure));
+        recompose({pending.figures.front().held.get(), figures.get(selected_id)});
+        commit_command();
+    }
+
+    void paint(const int& selected_id, const uint8_t& new_color){
+        if (figures.get(selected_id) == nullptr){
+            console() << "No figure selected\n";
+            return;
+        }
+        begin_command();
+        perform(FigureChange::Restyle, selected_id, nullptr, new_color);
+        recompose({figures.get(selected_id)});
+        commit_command();
+    }
+};
+
+class FileSystem {
+private:
+    // Ids a snapshot may have used up beyond its figures, by removals and refused adds; more is taken as damage.
+    static const uint32_t MAX_ID_GAP = 1 << 24;
+
+    string path;
+    Blackboard* blackboard;
+    // Version to save instead of freezing the board again, if the caller already holds one.
+    shared_ptr<const BoardSnapshot> pinned;
+    int board_width;
+    int board_height;
+
+    shared_ptr<const BoardSnapshot> version(const bool& with_raster){
+        if (pinned && (pinned->has_raster || !with_raster)) return pinned;
+        return blackboard->snapshot(with_raster);
+    }
+
+    template <typename Write>
+    void store(Write write){
+        auto start = chrono::steady_clock::now();
+        size_t bytes = 0;
+        bool saved = replace_file(path, write, bytes);
+        blackboard->get_stats().record(Stats::Save, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(), bytes);
+        if (saved) console() << "File has been successfully saved!\n";
+        else console() << "Unable to open file\n";
+    }
+
+    // `colors` maps the indices the file was saved with to this process's palette; unmapped ones are 0.
+    unique_ptr<Figure> make_figure(const FigureRecord& record, const uint8_t* colors){
+        uint8_t color = colors[record.color];
+        if (!valid_params(record.kind, record.params) || color == 0){
+            return nullptr;
+        }
+        return build_figure(record.kind, record.fill != 0, color, record.params, record.id);
+    }
+
+    void load_binary(const char* data, const size_t& length){
+        SnapshotHeader header;
+        memcpy(&header, data, sizeof(header));
+
+        size_t records = sizeof(header) + (size_t)header.figure_count * sizeof(FigureRecord);
+        size_t tiles_at = records;
+        bool raster = header.flags & SNAPSHOT_RASTER;
+        uint32_t tile_count = 0;
+
+        if (header.version != SNAPSHOT_VERSION || !valid_board(header.width, header.height) || length < records){
+            console() << "File structure damaged\n";
+            return;
+        }
+
+        uint8_t colors[256] = {};
+        for (uint8_t i = 1; i < NAMED_COUNT; i++){
+            colors[i] = i;
+        }
+        // Extended colors are registered again by name; if they land on other indices than when saved,
+        // the saved tiles would show the wrong colors and the board is rasterized from the figures instead.
+        bool renumbered = false;
+        uint32_t color_count;
+        if (length < records + sizeof(color_count)){
+            console() << "File structure damaged\n";
+            return;
+        }
+        memcpy(&color_count, data + records, sizeof(color_count));
+        tiles_at = records + sizeof(color_count) + (size_t)color_count * sizeof(PaletteRecord);
+        if (length < tiles_at){
+            console() << "File structure damaged\n";
+            return;
+        }
+        for (uint32_t i = 0; i < color_count; i++){
+            PaletteRecord entry;
+            memcpy(&entry, data + records + sizeof(color_count) + i * sizeof(PaletteRecord), sizeof(entry));
+            string_view name(entry.name, strnlen(entry.name, sizeof(entry.name)));
+            if (Palette::is_named(entry.index)){
+                console() << "File structure damaged\n";
+                return;
+            }
+            if (!Palette::instance().resolve(name, colors[entry.index])){
+                if (Palette::is_extended(name)){
+                    console() << "Palette is full: all " << Palette::extended_capacity()
+                              << " extended colors are taken; clear or load a board to free those no figure uses\n";
+                }
+                else console() << "File structure damaged\n";
+                return;
+            }
+            renumbered |= colors[entry.index] != entry.index;
+        }
+
+        if (raster && !renumbered){
+            if (length < tiles_at + sizeof(tile_count)){
+                console() << "File structure damaged\n";
+                return;
+            }
+            memcpy(&tile_count, data + tiles_at, sizeof(tile_count));
+            if (length < tiles_at + sizeof(tile_count) + tile_count * Framebuffer::tile_record_size()){
+                console() << "File structure damaged\n";
+                return;
+            }
+        }
+        else raster = false;
+
+        // The figure table is indexed by id, so ids must be unique and below the file's next id, and that may not
+        // run further ahead of the figures than MAX_ID_GAP.
+        if (header.next_id < 0 || (uint64_t)header.next_id > (uint64_t)header.figure_count + MAX_ID_GAP){
+            console() << "File structure damaged\n";
+            return;
+        }
+        vector<bool> used_ids(header.next_id);
+        vector<unique_ptr<Figure>> loaded;
+        loaded.reserve(header.figure_count);
+        const char* cursor = data + sizeof(header);
+        for (uint32_t i = 0; i < header.figure_count; i++, cursor += sizeof(FigureRecord)){
+            FigureRecord record;
+            memcpy(&record, cursor, sizeof(record));
+            if (record.id < 0 || record.id >= header.next_id || used_ids[record.id] || !(loaded.emplace_back(make_figure(record, colors)))){
+                console() << "File structure damaged\n";
+                return;
+            }
+            used_ids[record.id] = true;
+        }
+        Shape::id = max(Shape::id, header.next_id);
+
+        bool restored;
+        if (raster){
+            restored = blackboard->restore(header.width, header.height, loaded, data + tiles_at + sizeof(tile_count), tile_count);
+        }
+        else restored = blackboard->restore(header.width, header.height, loaded);
+
+        if (!restored){
+            console() << "File structure damaged\n";
+        }
+    }
+    // Value between `label(` and the matching `)` of a get_info() field, with surrounding spaces trimmed.
+    static bool field(const string_view& line, const string_view& label, string_view& value){
+        size_t start = line.find(label);
+        if (start == string_view::npos) return false;
+        start += label.size();
+        size_t end = line.find(')', start);
+        if (end == string_view::npos) return false;
+
+        value = line.substr(start, end - start);
+        while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+        while (!value.empty() && value.back() == ' ') value.remove_suffix(1);
+        return true;
+    }
+
+    static bool number(const string_view& text, int& value){
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == errc() && result.ptr == text.data() + text.size();
+    }
+
+    // One figure line of the text format; returns false if the line is damaged.
+    bool parse_line(const string_view& line, vector<unique_ptr<Figure>>& loaded,
+                    unordered_set<GeometryKey, GeometryHash>& seen){
+        static const pair<string_view, string_view> SIZE_FIELDS[] = {{"Square", "size("}, {"Triangle", "height("}, {"Circle", "radius("}, {"Line", "length("}};
+        string_view type = line.substr(0, line.find(':'));
+        string_view size_text, coordinates, color, filled, angle_text;
+        int kind = 0;
+        int32_t params[4] = {};
+        uint8_t color_id = 0;
+
+        while (kind < SHAPE_LINE + 1 && SIZE_FIELDS[kind].first != type) kind++;
+        if (kind > SHAPE_LINE || !field(line, SIZE_FIELDS[kind].second, size_text) || !field(line, "coordinates(", coordinates)
+            || !field(line, "color(", color)){
+            return false;
+        }
+        // Lines carry an angle instead of a fill flag.
+        int* position = params + 1;
+        if (kind == SHAPE_LINE){
+            if (!field(line, "angle(", angle_text) || !number(angle_text, params[1])) return false;
+            position++;
+        }
+        else if (!field(line, "filled(", filled)) return false;
+
+        size_t comma = coordinates.find(',');
+        if (comma == string_view::npos || !number(size_text, params[0]) || !number(coordinates.substr(0, comma), position[0])
+            || !number(coordinates.substr(comma + 1), position[1]) || !valid_params(kind, params)){
+            return false;
+        }
+        // Named colors are written as their symbol, extended ones by name.
+        if (color.size() == 1) color_id = Palette::by_symbol(color[0]);
+        else if (!Palette::instance().resolve(color, color_id)) return false;
+        if (color_id == 0){
+            return false;
+        }
+
+        auto figure = build_figure(kind, filled == "yes", color_id, params, Shape::id++);
+        if (figure->place(board_width, board_height)){
+            console() << "Figure is outside the box\n";
+        }
+        else if (!seen.insert(figure->key()).second){
+            console() << "Same figure exists\n";
+        }
+        else loaded.push_back(move(figure));
+        return true;
+    }
+
+    // Streams the file through a fixed buffer and slices lines in place, so memory stays constant
+    // apart from the figures themselves. The board is only replaced, and rasterized once, after the whole file parsed.
+    void load_text(){
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1){
+            console() << "Unable to open file\n";
+            return;
+        }
+
+        vector<unique_ptr<Figure>> loaded;
+        unordered_set<GeometryKey, GeometryHash> seen;
+        vector<char> buffer(1 << 20);
+        size_t filled = 0;
+        bool done = false;
+        bool damaged = false;
+
+        while (!done && !damaged){
+            if (filled == buffer.size()){
+                buffer.resize(buffer.size() * 2);
+            }
+            ssize_t count = read(fd, buffer.data() + filled, buffer.size() - filled);
+            if (count <= 0){
+                done = true;
+                if (filled == 0) break;
+                buffer[filled++] = '\n';
+            }
+            else filled += count;
+
+            string_view chunk(buffer.data(), filled);
+            size_t start = 0;
+            size_t end;
+            while ((end = chunk.find('\n', start)) != string_view::npos){
+                string_view line = chunk.substr(start, end - start);
+                start = end + 1;
+                if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+                if (line.empty()) continue;
+                if (line[0] == '0'){
+                    done = true;
+                    break;
+                }
+                if (line.substr(0, 6) == "Board:"){
+                    string_view size;
+                    size_t comma;
+                    if (!loaded.empty() || !field(line, "size(", size) || (comma = size.find(',')) == string_view::npos
+                        || !number(size.substr(0, comma), board_width) || !number(size.substr(comma + 1), board_height)
+                        || !valid_board(board_width, board_height)){
+                        damaged = true;
+                        break;
+                    }
+                    continue;
+                }
+                if (!parse_line(line, loaded, seen)){
+                    damaged = true;
+                    break;
+                }
+            }
+            memmove(buffer.data(), buffer.data() + start, filled - start);
+            filled -= start;
+        }
+        close(fd);
+
+        if (damaged){
+            console() << "File structure damaged\n";
+            return;
+        }
+        blackboard->restore(board_width, board_height, loaded);
+    }
+public:
+    FileSystem(const string& path, Blackboard* blackboard, shared_ptr<const BoardSnapshot> pinned = nullptr): path(path), blackboard(blackboard),
+        pinned(move(pinned)), board_width(blackboard->get_width()), board_height(blackboard->get_height()){}
+
+    // Snapshot file of a frozen board: header, figure records, the extended colors they use, then optionally the tiles.
+    static void encode_binary(ostream& file, const BoardSnapshot& board, const bool& with_raster){
+        vector<FigureRecord> records;
+        records.reserve(board.figures->size());
+        bool used[256] = {};
+        board.figures->for_each([&](const Figure& figure){
+            FigureRecord record = to_record(figure);
+            records.push_back(record);
+            used[record.color] = true;
+        });
+
+        Palette& palette = Palette::instance();
+        vector<PaletteRecord> colors;
+        for (size_t i = NAMED_COUNT; i < palette.size(); i++){
+            if (!used[i]) continue;
+            PaletteRecord entry = {(uint8_t)i, {}};
+            palette.name(i).copy(entry.name, sizeof(entry.name) - 1);
+            colors.push_back(entry);
+        }
+        uint32_t color_count = colors.size();
+
+        SnapshotHeader header = {{SNAPSHOT_MAGIC[0], SNAPSHOT_MAGIC[1], SNAPSHOT_MAGIC[2], SNAPSHOT_MAGIC[3]}, SNAPSHOT_VERSION,
+                                 with_raster ? SNAPSHOT_RASTER : (uint16_t)0, board.width, board.height,
+                                 (uint32_t)records.size(), board.next_id};
+
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)records.data(), records.size() * sizeof(FigureRecord));
+        file.write((const char*)&color_count, sizeof(color_count));
+        file.write((const char*)colors.data(), colors.size() * sizeof(PaletteRecord));
+
+        if (with_raster){
+            board.raster.write_tiles(file);
+        }
+    }
+
+    // Text file of a frozen board: its size, then one line per figure as list shows it, or 0 for an empty board.
+    static string encode_text(const BoardSnapshot& board){
+        string file = "Board: size( " + to_string(board.width) + "," + to_string(board.height) + " )\n";
+        board.figures->for_each([&](const Figure& figure){
+            file += figure.describe();
+        });
+        if (board.figures->empty()) file += '0';
+        return file;
+    }
+
+    // Saves write out a frozen version of the board, never the live one, and replace the file only once the new
+    // one is complete.
+    void save_binary(const bool& with_raster){
+        shared_ptr<const BoardSnapshot> board = version(with_raster);
+        store([&](ostream& out){ encode_binary(out, *board, with_raster); });
+    }
+
+    void save(){
+        shared_ptr<const BoardSnapshot> board = version(false);
+        string data = encode_text(*board);
+        store([&](ostream& out){ out.write(data.data(), data.size()); });
+    }
+
+    void load(){
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd != -1){
+            struct stat info;
+            if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SnapshotHeader)){
+                void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED){
+                    bool binary = memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+                    if (binary){
+                        madvise(data, info.st_size, MADV_SEQUENTIAL);
+                        load_binary((const char*)data, info.st_size);
+                    }
+                    munmap(data, info.st_size);
+                    if (binary){
+                        close(fd);
+                        return;
+                    }
+                }
+            }
+            close(fd);
+        }
+
+        load_text();
+    }
+};
+
+// Saves the board in the background: every `interval` while it keeps changing, once more when the session ends,
+// and whenever asked. Taking a version of the board is all it costs commands; encoding it and writing the file
+// happen on the autosave thread. Periodic versions are taken there too, holding the board lock shared for as long
+// as freezing takes, so a board left idle after a change still gets saved. Versions queued faster than they are
+// written are skipped in favor of the newest.
+class Autosaver{
+private:
+    string path;
+    chrono::steady_clock::duration interval;
+    Blackboard* blackboard;
+    shared_mutex& board_lock;
+    // Snapshot files for .bbs paths, text files for the rest, as with save.
+    bool binary;
+
+    mutex lock;
+    condition_variable wake;
+    shared_ptr<const BoardSnapshot> queued;
+    bool stopping = false;
+    // Last version written; only the autosave thread touches it. Not held, as a version keeps palette colors.
+    weak_ptr<const BoardSnapshot> written;
+    thread worker;
+
+    void write(shared_ptr<const BoardSnapshot> version){
+        if (version == written.lock()) return;
+        auto start = chrono::steady_clock::now();
+        size_t bytes = 0;
+        bool saved = replace_file(path, [&](ostream& out){
+            if (binary) FileSystem::encode_binary(out, *version, version->has_raster);
+            else out << FileSystem::encode_text(*version);
+        }, bytes);
+        if (!saved){
+            console_error() << "Autosave to " << path << " failed: " << strerror(errno) << "\n";
+            return;
+        }
+        written = version;
+        blackboard->get_stats().record(Stats::Autosave, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(), bytes);
+    }
+
+    void run(){
+        unique_lock<mutex> guard(lock);
+        auto due = chrono::steady_clock::now() + interval;
+        while (true){
+            wake.wait_until(guard, due, [&](){ return stopping || queued; });
+            bool last = stopping;
+            shared_ptr<const BoardSnapshot> version = last ? nullptr : move(queued);
+            guard.unlock();
+            if (!version){
+                shared_lock<shared_mutex> board(board_lock);
+                version = blackboard->snapshot(false);
+            }
+            write(move(version));
+            guard.lock();
+            if (last) break;
+            due = chrono::steady_clock::now() + interval;
+        }
+    }
+public:
+    Autosaver(const string& path, const int& seconds, Blackboard* blackboard, shared_mutex& board_lock) : path(path),
+        interval(chrono::seconds(seconds)), blackboard(blackboard), board_lock(board_lock),
+        binary(path.size() > 4 && path.compare(path.size() - 4, 4, ".bbs") == 0) {
+        worker = thread(&Autosaver::run, this);
+    }
+
+    ~Autosaver(){
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    const string& get_path() const { return path; }
+
+    // Queues a version taken by the caller, who holds the board.
+    void request(shared_ptr<const BoardSnapshot> version){
+        lock_guard<mutex> guard(lock);
+        queued = move(version);
+        wake.notify_one();
+    }
+};
+
+// Command names are mapped to slots by a seeded FNV-1a hash; the seed is searched at compile time
+// so that every name lands in its own slot and lookup is one hash plus one comparison.
+enum class CommandId : uint8_t { None, Draw, View, Live, List, Shapes, Undo, Redo, History, Clear, Remove, Edit, Paint, Select, Save, Load, Add, Begin, Commit, Rollback, Stats, Autosave };
+
+struct CommandName{
+    string_view name;
+    CommandId id;
+};
+
+constexpr CommandName COMMAND_NAMES[] = {
+    {"draw", CommandId::Draw}, {"view", CommandId::View}, {"live", CommandId::Live}, {"list", CommandId::List}, {"shapes", CommandId::Shapes},
+    {"undo", CommandId::Undo}, {"redo", CommandId::Redo}, {"history", CommandId::History}, {"clear", CommandId::Clear},
+    {"remove", CommandId::Remove}, {"edit", CommandId::Edit}, {"paint", CommandId::Paint}, {"select", CommandId::Select},
+    {"save", CommandId::Save}, {"load", CommandId::Load}, {"add", CommandId::Add}, {"begin", CommandId::Begin},
+    {"commit", CommandId::Commit}, {"rollback", CommandId::Rollback}, {"stats", CommandId::Stats}, {"autosave", CommandId::Autosave}
+};
+
+constexpr size_t COMMAND_SLOTS = 64;
+
+constexpr uint32_t command_hash(const string_view& name, const uint32_t& seed){
+    uint32_t hash = seed;
+    for (char c : name){
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return (hash >> 8) % COMMAND_SLOTS;
+}
+
+constexpr uint32_t find_command_seed(){
+    for (uint32_t seed = 1; seed < 100000; seed++){
+        bool used[COMMAND_SLOTS] = {};
+        bool perfect = true;
+        for (auto& command : COMMAND_NAMES){
+            uint32_t slot = command_hash(command.name, seed);
+            if (used[slot]){
+                perfect = false;
+                break;
+            }
+            used[slot] = true;
+        }
+        if (perfect) return seed;
+    }
+    return 0;
+}
+
+constexpr uint32_t COMMAND_SEED = find_command_seed();
+static_assert(COMMAND_SEED != 0, "no collision-free seed for the command table");
+
+struct CommandTable{
+    CommandName slots[COMMAND_SLOTS] = {};
+
+    constexpr CommandTable(){
+        for (auto& command : COMMAND_NAMES){
+            slots[command_hash(command.name, COMMAND_SEED)] = command;
+        }
+    }
+
+    constexpr CommandId find(const string_view& name) const {
+        const CommandName& slot = slots[command_hash(name, COMMAND_SEED)];
+        return slot.name == name ? slot.id : CommandId::None;
+    }
+};
+
+constexpr CommandTable COMMANDS;
+
+class Parser {
+private:
+    static const size_t MAX_TOKENS = 16;
+
+    Blackboard* blackboard;
+    string_view parts[MAX_TOKENS];
+    size_t count = 0;
+    // Each parser is one user's session: it keeps their selection, and knows whether they sit at a terminal.
+    int selected_id = -1;
+    bool terminal = true;
+    // Version the next command reads from instead of the live board; see pin().
+    shared_ptr<const BoardSnapshot> pinned;
+    // Journal ticket of the last command that changed the board; see sync().
+    uint64_t unsynced = 0;
+    Autosaver* autosaver = nullptr;
+    // Figures added since begin, held back until commit; a rejected add line fails the whole batch.
+    bool batching = false;
+    vector<unique_ptr<Figure>> batch;
+    size_t rejected = 0;
+    // Keeps the colors of the batched figures while other sessions clear or load the board.
+    Palette::Hold batch_colors;
+
+    // Splits on runs of spaces into views of the original line; tokens past MAX_TOKENS are only counted.
+    void split(const string_view& line) {
+        count = 0;
+        size_t pos = 0;
+        while (pos < line.size()) {
+            if (line[pos] == ' ') {
+                pos++;
+                continue;
+            }
+            size_t end = line.find(' ', pos);
+            if (end == string_view::npos) end = line.size();
+            if (count < MAX_TOKENS) parts[count] = line.substr(pos, end - pos);
+            count++;
+            pos = end;
+        }
+    }
+
+    static bool to_int(const string_view& text, int& value) {
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == errc() && result.ptr == text.data() + text.size();
     }
-    else if (command == "undo"){
-        blackboard->undo();
+
+    // Colors are resolved here, once per command; everything past the parser only sees palette indices.
+    static bool to_color(const string_view& name, uint8_t& index) {
+        if (Palette::instance().resolve(name, index)) return true;
+        if (Palette::is_extended(name)){
+            console() << "Palette is full: all " << Palette::extended_capacity()
+                      << " extended colors are taken; clear or load a board to free those no figure uses\n";
+        }
+        else console() << "No such color\n";
+        return false;
     }
-    else if (command == "clear"){
-        blackboard->clear();
+
+    bool ints(const size_t& first, int* values, const size_t& n) {
+        for (size_t i = 0; i < n; i++){
+            if (first + i >= count || !to_int(parts[first + i], values[i])){
+                console() << "Please, provide only valid integers\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Counts and limits: integers above zero.
+    bool positive(const size_t& first, int* values, const size_t& n) {
+        if (!ints(first, values, n)) return false;
+        for (size_t i = 0; i < n; i++){
+            if (values[i] <= 0){
+                console() << "Please, provide only positive integers\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Sizes and coordinates are checked here, before a figure is built from them.
+    bool size(const int& value) {
+        if (value <= 0) console() << "Please, provide positive numbers for size\n";
+        else if (value > MAX_FIGURE_SIZE) console() << "Size must not exceed " << MAX_FIGURE_SIZE << "\n";
+        else return true;
+        return false;
+    }
+
+    bool position(const int& x, const int& y) {
+        if (valid_coordinate(x) && valid_coordinate(y)) return true;
+        console() << "Coordinates must lie within " << -MAX_COORDINATE << " and " << MAX_COORDINATE << "\n";
+        return false;
+    }
+
+public:
+     Parser(Blackboard* blackboard) : blackboard(blackboard) {}
+
+    void set_terminal(const bool& enabled) {
+        terminal = enabled;
+    }
+
+    void set_autosaver(Autosaver* target) {
+        autosaver = target;
     }
-    else if (command == "remove"){
-        blackboard->remove();
+
+    // Waits until the changes of the commands run so far are in the journal on disk. Kept apart from
+    // parse_command() so that a server can wait without holding the board.
+    void sync() {
+        blackboard->sync_journal(unsynced);
+        unsynced = 0;
     }
-    else if(command == "edit"){
-        blackboard->edit(stoi(parts[1]));
+
+    // Makes the next command run on a frozen version of the board, if it is one that can; see frozen().
+    void pin(shared_ptr<const BoardSnapshot> version) {
+        pinned = move(version);
     }
-    else if(command == "paint"){
-        blackboard->paint(parts[1]);
+
+    // Command of a line, and whether anything follows it.
+    static CommandId classify(const string_view& command_line, bool& argument) {
+        size_t start = command_line.find_first_not_of(' ');
+        argument = false;
+        if (start == string_view::npos) return CommandId::None;
+        size_t end = command_line.find(' ', start);
+        argument = end != string_view::npos && command_line.find_first_not_of(' ', end) != string_view::npos;
+        return COMMANDS.find(command_line.substr(start, end == string_view::npos ? end : end - start));
     }
-    else if (command == "select"){
-        if(parts.size() == 3){
-            blackboard->select_figure_by_coord(stoi(parts[1]), stoi(parts[2]));
+
+    // Whether a command line may change the board. All other commands only read it, so a server can run them
+    // side by side.
+    static bool writes(const string_view& command_line) {
+        bool argument;
+        switch (classify(command_line, argument)) {
+        case CommandId::None:
+        case CommandId::Draw:
+        case CommandId::Live:
+        case CommandId::List:
+        case CommandId::Shapes:
+        case CommandId::Select:
+        case CommandId::Save:
+        case CommandId::Stats:
+        case CommandId::Autosave:
+        case CommandId::Begin:
+        case CommandId::Rollback:
+            return false;
+        case CommandId::History:
+            return argument;
+        default:
+            return true;
         }
-        else{ blackboard->select_by_id(stoi(parts[1])); }
     }
-    else if (command == "save"){
-        if(parts.size() > 1){
-            FileSystem fs(parts[1], blackboard);
-            fs.save();
+
+    // Whether a command line reads nothing but a frozen version of the board once one is pinned.
+    static bool frozen(const string_view& command_line) {
+        bool argument;
+        switch (classify(command_line, argument)) {
+        case CommandId::Draw:
+        case CommandId::List:
+        case CommandId::Save:
+        case CommandId::Autosave:
+            return true;
+        default:
+            return false;
         }
-        else cout << "Please provide a filename to save.\n";
-    } 
-    else if (command == "load"){
-        if(parts.size() > 1){
-            FileSystem fs(parts[1], blackboard);
-            fs.load();
-        }            
-        else cout << "Please provide a filename to load.\n";
     }
-    else if(command == "add"){
-        if(parts.size() < 4) {
-            cout << "Oups! It's incorrect command usage. Type shapes command to see correct usage\n";
-            return;
+
+    // Runs one command line and records its latency under the command's name.
+    void parse_command(const string_view& command_line) {
+        auto start = chrono::steady_clock::now();
+        execute(command_line);
+        pinned.reset();
+        if (writes(command_line)) unsynced = blackboard->log_command();
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+        string_view name = "unknown";
+        if (count == 0) name = "empty";
+        else if (COMMANDS.find(parts[0]) != CommandId::None) name = parts[0];
+        blackboard->get_stats().record_command(name, elapsed);
+    }
+
+private:
+    void execute(const string_view& command_line) {
+    split(command_line);
+    if (count == 0) {
+        console() << "Start typing" << endl;
+        return;
+    }
+
+    int values[4];
+    uint8_t color_id;
+    CommandId command = COMMANDS.find(parts[0]);
+
+    // A batch only takes adds until it ends; other changes to the board would slip in between its figures.
+    if (batching && command != CommandId::Add && command != CommandId::Commit && command != CommandId::Rollback && writes(command_line)) {
+        console() << "Finish the batch with commit or rollback first\n";
+        return;
+    }
+
+    switch (command) {
+    case CommandId::Draw:
+        if (pinned) blackboard->draw(*pinned);
+        else blackboard->draw();
+        break;
+    case CommandId::View:
+        if (count == 1) blackboard->reset_view();
+        else if (ints(1, values, 4)) blackboard->set_view(values[0], values[1], values[2], values[3]);
+        else return;
+        blackboard->draw();
+        break;
+    case CommandId::Live:
+        if (!terminal){
+            console() << "Live mode needs a terminal session\n";
+        }
+        else if (count > 1 && (parts[1] == "on" || parts[1] == "off")){
+            blackboard->set_live(parts[1] == "on");
+        }
+        else console() << "Usage: live on|off\n";
+        break;
+    case CommandId::List:
+        if (pinned) Blackboard::list(*pinned);
+        else blackboard->list();
+        break;
+    case CommandId::Shapes:
+        blackboard->shapes();
+        break;
+    case CommandId::Undo:
+    case CommandId::Redo:
+        values[0] = 1;
+        if (count > 1 && !positive(1, values, 1)) return;
+        if (parts[0] == "undo") blackboard->undo(values[0]);
+        else blackboard->redo(values[0]);
+        break;
+    case CommandId::History:
+        if (count > 1){
+            if (!positive(1, values, 1)) return;
+            blackboard->set_history_limit((size_t)values[0] << 10);
+        }
+        blackboard->history_info();
+        break;
+    case CommandId::Clear:
+        blackboard->clear();
+        selected_id = -1;
+        break;
+    case CommandId::Remove:
+        blackboard->remove(selected_id);
+        break;
+    case CommandId::Edit:
+        if (ints(1, values, 1) && size(values[0])) blackboard->edit(selected_id, values[0]);
+        break;
+    case CommandId::Paint:
+        if (count > 1){
+            if (to_color(parts[1], color_id)) blackboard->paint(selected_id, color_id);
+        }
+        else console() << "Please provide a color.\n";
+        break;
+    case CommandId::Select:
+        if (count == 3){
+            if (ints(1, values, 2)) blackboard->select_figure_by_coord(values[0], values[1], selected_id);
+        }
+        else if (ints(1, values, 1)) blackboard->select_by_id(values[0], selected_id);
+        break;
+    case CommandId::Save:
+        if (count > 1){
+            string path(parts[1]);
+            FileSystem fs(path, blackboard, pinned);
+            string_view format = count > 2 ? parts[2] : "";
+            bool snapshot = path.size() > 4 && path.compare(path.size() - 4, 4, ".bbs") == 0;
+
+            if (format == "binary") fs.save_binary(false);
+            else if (format == "raster" || (format.empty() && snapshot)) fs.save_binary(true);
+            else fs.save();
+        }
+        else console() << "Please provide a filename to save.\n";
+        break;
+    case CommandId::Load:
+        if (count > 1){
+            FileSystem fs(string(parts[1]), blackboard);
+            fs.load();
+            selected_id = -1;
+        }
+        else console() << "Please provide a filename to load.\n";
+        break;
+    case CommandId::Add: {
+        unique_ptr<Figure> added;
+        string_view figure = count > 1 ? parts[1] : "";
+        if (count < 4) {
+            console() << "Oups! It's incorrect command usage. Type shapes command to see correct usage\n";
+        }
+        else if (figure == "line" && count == 7){
+            if (ints(3, values, 4) && size(values[0]) && position(values[2], values[3]) && to_color(parts[2], color_id)){
+                added = make_unique<Figure>(Line(color_id, values[0], values[1], values[2], values[3]));
+            }
+        }
+        else if ((figure == "square" || figure == "triangle" || figure == "circle") && count == 7){
+            if (ints(4, values, 3) && size(values[0]) && position(values[1], values[2]) && to_color(parts[3], color_id)){
+                bool fill = parts[2] == "fill";
+                if (figure == "square") added = make_unique<Figure>(Square(fill, color_id, values[0], values[1], values[2]));
+                else if (figure == "triangle") added = make_unique<Figure>(Triangle(fill, color_id, values[0], values[1], values[2]));
+                else added = make_unique<Figure>(Circle(fill, color_id, values[0], values[1], values[2]));
+            }
         }
-        string figure = parts[1];
-        string fill = parts[2];
-        string color = parts[3];
-        
-
-        if (figure == "square" && parts.size() == 7){
-            try {
-                int size = stoi(parts[4]);
-                int x = stoi(parts[5]);
-                int y = stoi(parts[6]);
-                blackboard->add_square(fill,color, size, x, y);
-            } catch (exception& e) {
-                cout << "Please, provide only valid integers\n";
-            }
-        }
-
-        // else if (figure == "circle" && parts.size() == 5){
-        //     try {
-        //         int radius = stoi(parts[2]);
-        //         int x = stoi(parts[3]);
-        //         int y = stoi(parts[4]);
-        //         blackboard->add_circle(radius, x, y);
-        //     } catch (exception& e) {
-        //         cout << "Please, provide only valid integers\n";
-        //     }
-        // }
-
-        // else if (figure == "triangle" && parts.size() == 5){
-        //     try {
-        //         int height = stoi(parts[2]);
-        //         int x = stoi(parts[3]);
-        //         int y = stoi(parts[4]);
-        //         blackboard->add_triangle(height, x, y);
-        //     } catch (exception& e) {
-        //         cout << "Please, provide only valid integers\n";
-        //     }
-        // }
-
-        // else if (figure == "line" && parts.size() == 6){
-        //     try {
-        //         int length = stoi(parts[2]);
-        //         int angle = stoi(parts[3]);
-        //         int x = stoi(parts[4]);
-        //         int y = stoi(parts[5]);
-        //         blackboard->add_line(length, angle, x, y);
-        //     } catch (exception& e) {
-        //         cout << "Please, provide only valid integers\n";
-        //     }
-        // }
         else {
-            cout << "No such figure, enter 'shapes' to see available figures\n";
+            console() << "No such figure, enter 'shapes' to see available figures\n";
+        }
+
+        if (!added) rejected += batching;
+        else if (batching){
+            batch_colors.add(added->get_color());
+            batch.push_back(move(added));
         }
+        else blackboard->add(move(added));
+        break;
     }
-    else {
-        cout << "No such command. Available commands are:\n"
-             << "draw\nlist\nshapes\nundo\nclear\nsave\nload\nadd\n";
+    case CommandId::Begin:
+        if (batching){
+            console() << "A batch is already open, commit or rollback it first\n";
+            break;
+        }
+        batching = true;
+        rejected = 0;
+        break;
+    case CommandId::Commit:
+        if (!batching){
+            console() << "No batch to commit, start one with begin\n";
+            break;
+        }
+        batching = false;
+        if (rejected > 0) console() << rejected << " lines of the batch were rejected, nothing was added\n";
+        else if (blackboard->add_all(batch)) console() << "Added " << batch.size() << " figures\n";
+        else console() << "Nothing was added\n";
+        batch.clear();
+        batch_colors.clear();
+        break;
+    case CommandId::Rollback:
+        if (!batching){
+            console() << "No batch to roll back\n";
+            break;
+        }
+        batching = false;
+        console() << "Dropped " << batch.size() << " figures\n";
+        batch.clear();
+        batch_colors.clear();
+        break;
+    case CommandId::Stats:
+        if (count > 1 && parts[1] == "reset") blackboard->get_stats().reset();
+        else blackboard->print_stats(console());
+        break;
+    case CommandId::Autosave:
+        if (autosaver == nullptr){
+            console() << "Autosave is off, start with --autosave PATH\n";
+            break;
+        }
+        autosaver->request(pinned ? pinned : blackboard->snapshot(false));
+        console() << "Saving to " << autosaver->get_path() << " in the background\n";
+        break;
+    case CommandId::None:
+        console() << "No such command. Available commands are:\n"
+             << "draw\nview\nlive\nlist\nshapes\nundo\nredo\nhistory\nclear\nsave\nload\nadd\nbegin\ncommit\nrollback\nstats\nautosave\n";
+        break;
     }
 }
 };
 
+// Hosts one board for many local clients on a Unix domain socket, in the same command language as the terminal
+// session (`nc -U path` is enough of a client). One thread polls the listening socket and every connection and
+// hands complete lines to a fixed set of workers. Commands that only read the board hold the board lock shared,
+// so draws, lists and selects from different clients run side by side; commands that change it run alone. Draws,
+// lists and saves hold it only to pin a frozen version of the board, and run on that while writers go on.
+// Every client has its own parser, and with it its own selection, and at most one command in flight, so its
+// replies come back in order.
+class Server{
+private:
+    // A line longer than this closes the connection; replies piling up past it pause the client's commands.
+    static const size_t MAX_BUFFER = 1 << 20;
+    static constexpr const char* PROMPT = "Enter command: ";
+
+    struct Client{
+        int fd;
+        Parser parser;
+        string input;
+        string output;
+        bool busy = false;
+        // No more commands are read; the connection closes once the last reply is sent.
+        bool closing = false;
+        // The socket failed; the connection closes as soon as no command is running for it.
+        bool broken = false;
+
+        Client(const int& fd, Blackboard* blackboard, Autosaver* autosaver) : fd(fd), parser(blackboard) {
+            parser.set_terminal(false);
+            parser.set_autosaver(autosaver);
+        }
+    };
+
+    struct Job{
+        Client* client;
+        string line;
+    };
+
+    string path;
+    Blackboard* blackboard;
+    shared_mutex& board_lock;
+    Autosaver* autosaver;
+    int listener = -1;
+    int wake[2] = {-1, -1};
+    vector<unique_ptr<Client>> clients;
+
+    mutex jobs_lock;
+    condition_variable jobs_ready;
+    deque<Job> jobs;
+    bool stopping = false;
+    vector<thread> workers;
+
+    mutex done_lock;
+    vector<pair<Client*, string>> done;
+
+    static volatile sig_atomic_t interrupted;
+    static int signal_fd;
+
+    static void on_signal(int){
+        interrupted = 1;
+        char byte = 0;
+        ssize_t ignored = write(signal_fd, &byte, 1);
+        (void)ignored;
+    }
+
+    void notify(){
+        char byte = 0;
+        ssize_t ignored = write(wake[1], &byte, 1);
+        (void)ignored;
+    }
+
+    // Runs commands with their output captured into the reply, under the board lock they need.
+    void work(){
+        while (true){
+            Job job;
+            {
+                unique_lock<mutex> guard(jobs_lock);
+                jobs_ready.wait(guard, [&](){ return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+
+            ostringstream reply;
+            console_stream = &reply;
+            console_error_stream = &reply;
+            if (Parser::writes(job.line)){
+                {
+                    unique_lock<shared_mutex> guard(board_lock);
+                    job.client->parser.parse_command(job.line);
+                }
+                // The reply waits for the journal; commands of other clients share the sync meanwhile.
+                job.client->parser.sync();
+            }
+            else if (Parser::frozen(job.line)){
+                // The board is only held while its version is pinned; drawing or saving it then overlaps with writers.
+                {
+                    shared_lock<shared_mutex> guard(board_lock);
+                    job.client->parser.pin(blackboard->snapshot());
+                }
+                job.client->parser.parse_command(job.line);
+            }
+            else {
+                shared_lock<shared_mutex> guard(board_lock);
+                job.client->parser.parse_command(job.line);
+            }
+            console_stream = &cout;
+            console_error_stream = &cerr;
+
+            {
+                lock_guard<mutex> guard(done_lock);
+                done.emplace_back(job.client, reply.str());
+            }
+            notify();
+        }
+    }
+
+    // Starts the client's next complete command unless one is still running or its replies are backing up.
+    void dispatch(Client& client){
+        if (client.busy || client.broken || client.output.size() >= MAX_BUFFER){
+            return;
+        }
+        size_t end = client.input.find('\n');
+        if (end == string::npos){
+            if (client.input.size() > MAX_BUFFER){
+                client.output += "Command is too long\n";
+                client.input.clear();
+                client.closing = true;
+            }
+            return;
+        }
+
+        string line = client.input.substr(0, end);
+        client.input.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line == "exit"){
+            client.input.clear();
+            client.closing = true;
+            return;
+        }
+
+        client.busy = true;
+        {
+            lock_guard<mutex> guard(jobs_lock);
+            jobs.push_back({&client, move(line)});
+        }
+        jobs_ready.notify_one();
+    }
+
+    // Hands finished replies back to their clients.
+    void collect(){
+        char bytes[256];
+        while (read(wake[0], bytes, sizeof(bytes)) > 0) {}
+
+        vector<pair<Client*, string>> finished;
+        {
+            lock_guard<mutex> guard(done_lock);
+            finished.swap(done);
+        }
+        for (auto& [client, reply] : finished){
+            client->busy = false;
+            if (client->broken) continue;
+            client->output += reply;
+            client->output += PROMPT;
+        }
+    }
+
+    void accept_clients(){
+        while (true){
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) return;
+            clients.push_back(make_unique<Client>(fd, blackboard, autosaver));
+            clients.back()->output = PROMPT;
+        }
+    }
+
+    void receive(Client& client){
+        char buffer[64 << 10];
+        while (client.input.size() <= MAX_BUFFER){
+            ssize_t count = read(client.fd, buffer, sizeof(buffer));
+            if (count > 0){
+                client.input.append(buffer, count);
+                continue;
+            }
+            if (count == 0){
+                // The client is done sending; whatever it sent still runs.
+                if (!client.input.empty() && client.input.back() != '\n') client.input += '\n';
+                client.closing = true;
+            }
+            else if (errno == EINTR) continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) client.broken = true;
+            return;
+        }
+    }
+
+    void transmit(Client& client){
+        while (!client.output.empty()){
+            ssize_t count = send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+            if (count > 0){
+                client.output.erase(0, count);
+                continue;
+            }
+            if (count == -1 && errno == EINTR) continue;
+            if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            client.broken = true;
+            client.output.clear();
+            return;
+        }
+    }
+
+    static bool finished(const Client& client){
+        if (client.busy) return false;
+        return client.broken || (client.closing && client.output.empty() && client.input.find('\n') == string::npos);
+    }
+
+    void shutdown(){
+        {
+            lock_guard<mutex> guard(jobs_lock);
+            stopping = true;
+        }
+        jobs_ready.notify_all();
+        for (auto& worker : workers){
+            worker.join();
+        }
+        workers.clear();
+        for (auto& client : clients){
+            close(client->fd);
+        }
+        clients.clear();
+        for (int fd : {listener, wake[0], wake[1]}){
+            if (fd != -1) close(fd);
+        }
+        listener = wake[0] = wake[1] = -1;
+    }
+
+public:
+    // The board lock is shared with whoever else reads the board, such as an autosaver.
+    Server(const string& path, Blackboard* blackboard, shared_mutex& board_lock, Autosaver* autosaver = nullptr) : path(path),
+        blackboard(blackboard), board_lock(board_lock), autosaver(autosaver) {}
+
+    // Serves until SIGINT or SIGTERM; returns false if the socket could not be set up. A stale socket left
+    // at the path by an earlier server is replaced, any other file is not.
+    bool run(const int& threads){
+        sockaddr_un address = {};
+        if (path.size() >= sizeof(address.sun_path)){
+            cerr << "Socket path is too long\n";
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        struct stat info;
+        if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)){
+            unlink(path.c_str());
+        }
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener == -1 || bind(listener, (sockaddr*)&address, sizeof(address)) == -1 || listen(listener, SOMAXCONN) == -1
+            || pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1){
+            cerr << "Unable to listen on " << path << ": " << strerror(errno) << "\n";
+            shutdown();
+            return false;
+        }
+
+        interrupted = 0;
+        signal_fd = wake[1];
+        struct sigaction action = {};
+        action.sa_handler = on_signal;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+
+        for (int i = 0; i < max(1, threads); i++){
+            workers.emplace_back(&Server::work, this);
+        }
+        cerr << "Serving on " << path << "\n";
+
+        vector<pollfd> polled;
+        while (!interrupted){
+            polled.clear();
+            polled.push_back({listener, POLLIN, 0});
+            polled.push_back({wake[0], POLLIN, 0});
+            for (auto& client : clients){
+                short events = 0;
+                if (!client->closing && !client->broken && client->input.size() <= MAX_BUFFER) events |= POLLIN;
+                if (!client->output.empty() && !client->broken) events |= POLLOUT;
+                polled.push_back({client->fd, events, 0});
+            }
+            if (poll(polled.data(), polled.size(), -1) == -1){
+                if (errno == EINTR) continue;
+                cerr << "Server stopped: " << strerror(errno) << "\n";
+                break;
+            }
+
+            if (polled[1].revents & POLLIN) collect();
+            for (size_t i = 2; i < polled.size(); i++){
+                Client& client = *clients[i - 2];
+                if (polled[i].revents & POLLIN) receive(client);
+                else if (polled[i].revents & (POLLHUP | POLLERR)) client.broken = true;
+                if (polled[i].revents & POLLOUT) transmit(client);
+            }
+            if (polled[0].revents & POLLIN) accept_clients();
+
+            for (auto& client : clients){
+                dispatch(*client);
+                if (!client->output.empty() && !client->broken) transmit(*client);
+            }
+            for (size_t i = 0; i < clients.size();){
+                if (finished(*clients[i])){
+                    close(clients[i]->fd);
+                    clients.erase(clients.begin() + i);
+                }
+                else i++;
+            }
+        }
+
+        shutdown();
+        unlink(path.c_str());
+        return true;
+    }
+};
+
+volatile sig_atomic_t Server::interrupted = 0;
+int Server::signal_fd = -1;
+
 class Engine {
+private:
+    int width = 90;
+    int height = 50;
+    int threads = thread::hardware_concurrency();
+    bool dump_stats = false;
+    string journal_path;
+    string autosave_path;
+    int autosave_seconds = 30;
+
+    // Without a journal path the board starts empty and nothing is logged.
+    bool recover(Blackboard& blackboard, CommandJournal& journal) {
+        return journal_path.empty() || blackboard.recover(journal, journal_path);
+    }
+
+    // Nothing unless an autosave path was set; declared after the board so the final save runs first.
+    unique_ptr<Autosaver> autosave(Blackboard& blackboard, shared_mutex& board_lock) {
+        if (autosave_path.empty()) return nullptr;
+        return make_unique<Autosaver>(autosave_path, autosave_seconds, &blackboard, board_lock);
+    }
 public:
+    void set_size(const int& board_width, const int& board_height) {
+        width = board_width;
+        height = board_height;
+    }
+
+    void set_threads(const int& count) {
+        threads = count;
+    }
+
+    // Prints the stats report to stderr when the session ends.
+    void set_dump_stats(const bool& enabled) {
+        dump_stats = enabled;
+    }
+    // Recovers the board from a journal at `path` and logs every change to it.
+    void set_journal(const string& path) {
+        journal_path = path;
+    }
+    // Saves the board to `path` from a background thread every `seconds` it has changed, and on demand.
+    void set_autosave(const string& path, const int& seconds) {
+        autosave_path = path;
+        autosave_seconds = seconds;
+    }
+
     void run() {
-        Blackboard blackboard;
+        CommandJournal journal;
+        Blackboard blackboard(width, height);
+        blackboard.set_threads(threads);
+        if (!recover(blackboard, journal)) return;
+        shared_mutex board_lock;
+        unique_ptr<Autosaver> autosaver = autosave(blackboard, board_lock);
         string input;
         Parser parser(&blackboard);
+        parser.set_autosaver(autosaver.get());
         while (true) {
             cout << "Enter command: ";
-            getline(cin, input);
 
-            if (input == "exit") {
+            if (!getline(cin, input) || input == "exit") {
                 break;
             }
-            parser.parse_command(input);
+            {
+                unique_lock<shared_mutex> guard(board_lock);
+                parser.parse_command(input);
+                blackboard.refresh();
+            }
+            parser.sync();
+        }
+        if (blackboard.is_live()) blackboard.set_live(false);
+        if (dump_stats) blackboard.print_stats(cerr);
+    }
+
+    // Hosts one board for clients of a Unix domain socket until interrupted; false if the socket could not be set up.
+    bool serve(const string& path) {
+        CommandJournal journal;
+        Blackboard blackboard(width, height);
+        blackboard.set_threads(threads);
+        if (!recover(blackboard, journal)) return false;
+        shared_mutex board_lock;
+        unique_ptr<Autosaver> autosaver = autosave(blackboard, board_lock);
+        Server server(path, &blackboard, board_lock, autosaver.get());
+        if (!server.run(threads)) return false;
+        if (dump_stats) blackboard.print_stats(cerr);
+        return true;
+    }
+
+    // Runs a script without prompts. Rasterization is deferred until an explicit draw or the end of the script.
+    void run_batch(const string& path) {
+        ifstream file;
+        if (path != "-"){
+            file.open(path);
+            if (!file.is_open()){
+                cerr << "Unable to open file\n";
+                return;
+            }
+        }
+        istream& in = path == "-" ? cin : file;
+
+        CommandJournal journal;
+        Blackboard blackboard(width, height);
+        blackboard.set_threads(threads);
+        if (!recover(blackboard, journal)) return;
+        shared_mutex board_lock;
+        unique_ptr<Autosaver> autosaver = autosave(blackboard, board_lock);
+        string input;
+        Parser parser(&blackboard);
+        parser.set_autosaver(autosaver.get());
+        size_t commands = 0;
+
+        auto start = chrono::steady_clock::now();
+        {
+            unique_lock<shared_mutex> guard(board_lock);
+            blackboard.set_deferred(true);
+        }
+        while (getline(in, input) && input != "exit") {
+            if (input.empty()) continue;
+            {
+                unique_lock<shared_mutex> guard(board_lock);
+                parser.parse_command(input);
+            }
+            commands++;
+        }
+        auto parsed = chrono::steady_clock::now();
+        {
+            // Ending deferral rebuilds the board, which the autosaver must not read meanwhile.
+            unique_lock<shared_mutex> guard(board_lock);
+            blackboard.set_deferred(false);
         }
+        auto finished = chrono::steady_clock::now();
+        cout.flush();
+
+        double total = chrono::duration<double, milli>(finished - start).count();
+        double raster = chrono::duration<double, milli>(finished - parsed).count();
+        cerr << "Batch " << (path == "-" ? "stdin" : path) << ": " << commands << " commands in " << total << " ms ("
+             << raster << " ms final rasterization, " << (total > 0 ? commands / total * 1000 : 0) << " commands/s)\n";
+        if (dump_stats) blackboard.print_stats(cerr);
+    }
+};
+
+#ifdef BLACKBOARD_BENCH
+// Benchmark suite, built with -DBLACKBOARD_BENCH in place of the interactive program:
+//     g++ -std=c++17 -O2 -DBLACKBOARD_BENCH blackboard.cpp -o blackboard_bench
+// Every measurement is printed as one JSON object per line. An optional argument keeps only the benchmarks
+// whose name contains it. Program output is discarded while timing.
+
+// Swallows everything written to it.
+class NullBuffer : public streambuf{
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+// Synthetic board: `figures` squares of side about `size` on a `width` x `height` board, `fill` percent of them
+// filled. They are scattered over a region sized so that on average `density` figures cover each of its cells.
+struct Workload{
+    const char* name;
+    int width;
+    int height;
+    int figures;
+    int size;
+    int fill;
+    double density;
+};
+
+const Workload WORKLOADS[] = {
+    {"small", 90, 50, 200, 5, 50, 1.0},
+    {"medium", 1000, 1000, 5000, 20, 50, 2.0},
+    {"dense", 1000, 1000, 5000, 40, 100, 8.0},
+    {"outline", 1000, 1000, 5000, 40, 0, 8.0},
+    {"large_figures", 2000, 2000, 500, 400, 50, 4.0},
+    {"sparse_board", 100000, 100000, 20000, 30, 50, 0.05},
+};
+
+const char* const BENCH_COLORS[] = {"red", "green", "blue", "yellow", "cyan", "magenta"};
+
+class Bench{
+private:
+    ostream& report;
+    string filter;
+    NullBuffer sink;
+
+public:
+    Bench(ostream& report, const string& filter) : report(report), filter(filter) {}
+
+    bool wanted(const string& name) const {
+        return filter.empty() || name.find(filter) != string::npos;
+    }
+
+    // Runs body() with program output discarded.
+    template <typename Body>
+    void quiet(Body body){
+        streambuf* saved = cout.rdbuf(&sink);
+        streambuf* saved_errors = cerr.rdbuf(&sink);
+        body();
+        cout.rdbuf(saved);
+        cerr.rdbuf(saved_errors);
+    }
+
+    // Times body() once and reports it as `ops` operations; `extra` is appended to the JSON object as is.
+    template <typename Body>
+    void measure(const string& name, const Workload& workload, const size_t& ops, Body body, const string& extra = ""){
+        if (!wanted(name)) return;
+        double total = 0;
+        quiet([&](){
+            auto start = chrono::steady_clock::now();
+            body();
+            total = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        });
+
+        report << "{\"bench\":\"" << name << "\",\"workload\":\"" << workload.name << "\",\"width\":" << workload.width
+               << ",\"height\":" << workload.height << ",\"figures\":" << workload.figures << ",\"size\":" << workload.size
+               << ",\"fill\":" << workload.fill << ",\"density\":" << workload.density << ",\"ops\":" << ops
+               << ",\"total_ms\":" << total << ",\"ns_per_op\":" << (ops ? total * 1e6 / ops : 0.0) << extra << "}\n";
     }
 };
 
-int main() {
+// Add commands for a workload, from a fixed seed so every run and every build sees the same board.
+vector<string> generate(const Workload& workload){
+    mt19937 random(42);
+    double area = (double)workload.figures * workload.size * workload.size / workload.density;
+    int side_x = (int)min((double)workload.width, sqrt(area));
+    int side_y = (int)min((double)workload.height, area / side_x);
+
+    vector<string> commands;
+    commands.reserve(workload.figures);
+    for (int i = 0; i < workload.figures; i++){
+        int size = max(1, workload.size / 2 + (int)(random() % workload.size));
+        int x = random() % max(1, side_x - size);
+        int y = size - 1 + random() % max(1, side_y - 2 * size + 2);
+        bool fill = (int)(random() % 100) < workload.fill;
+        commands.push_back("add square " + string(fill ? "fill" : "nofill") + " " + BENCH_COLORS[random() % 6] + " "
+                           + to_string(size) + " " + to_string(x) + " " + to_string(y));
+    }
+    return commands;
+}
+
+void run_workload(Bench& bench, const Workload& workload){
+    vector<string> commands = generate(workload);
+    mt19937 random(7);
+    const size_t probes = 10000;
+
+    // Hot paths of an interactive session on one board, in the order a user would hit them.
+    Blackboard blackboard(workload.width, workload.height);
+    Parser parser(&blackboard);
+    bench.measure("add_square", workload, commands.size(), [&](){
+        for (auto& command : commands){
+            parser.parse_command(command);
+        }
+    });
+    bench.measure("draw", workload, 20, [&](){
+        for (int i = 0; i < 20; i++) blackboard.draw();
+    });
+    int selected = -1;
+    bench.measure("select_figure_by_coord", workload, probes, [&](){
+        for (size_t i = 0; i < probes; i++){
+            blackboard.select_figure_by_coord(random() % workload.width, random() % workload.height, selected);
+        }
+    });
+    bench.measure("select_by_id", workload, probes, [&](){
+        for (size_t i = 0; i < probes; i++){
+            blackboard.select_by_id(random() % workload.figures, selected);
+        }
+    });
+
+    string text = string("blackboard_bench_") + workload.name + ".txt";
+    string snapshot = string("blackboard_bench_") + workload.name + ".bbs";
+    bench.measure("save_text", workload, 1, [&](){ FileSystem(text, &blackboard).save(); });
+    bench.measure("save_binary", workload, 1, [&](){ FileSystem(snapshot, &blackboard).save_binary(false); });
+    bench.measure("load_text", workload, 1, [&](){ FileSystem(text, &blackboard).load(); });
+    bench.measure("load_binary", workload, 1, [&](){ FileSystem(snapshot, &blackboard).load(); });
+    bench.measure("save_raster", workload, 1, [&](){ FileSystem(snapshot, &blackboard).save_binary(true); });
+    bench.measure("load_raster", workload, 1, [&](){ FileSystem(snapshot, &blackboard).load(); });
+    remove(text.c_str());
+    remove(snapshot.c_str());
+
+    // Loads bypass history, so undo is measured on a board built by commands again.
+    Blackboard replay(workload.width, workload.height);
+    Parser replay_parser(&replay);
+    bench.quiet([&](){
+        for (auto& command : commands){
+            replay_parser.parse_command(command);
+        }
+    });
+    bench.measure("undo", workload, commands.size(), [&](){
+        for (size_t i = 0; i < commands.size(); i++) replay.undo();
+    });
+
+    // The same adds as one batch on an empty board: queued by the parser, then validated and rasterized at commit.
+    Blackboard batched(workload.width, workload.height);
+    Parser batch_parser(&batched);
+    bench.measure("add_batch", workload, commands.size(), [&](){
+        batch_parser.parse_command("begin");
+        for (auto& command : commands){
+            batch_parser.parse_command(command);
+        }
+        batch_parser.parse_command("commit");
+    });
+
+    // The parser alone: an unknown shape name fails after tokenizing and dispatch, so no figure work is timed.
+    vector<string> unknown = commands;
+    for (auto& command : unknown){
+        command.replace(4, 6, "sqware");
+    }
+    bench.measure("parse_command", workload, unknown.size(), [&](){
+        for (auto& command : unknown){
+            parser.parse_command(command);
+        }
+    });
+}
+
+// Resident size of the process in KB, from /proc; 0 where that is not available.
+size_t resident_kb(){
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// A few huge outline figures on a 1M x 1M board: their tiles cover a sliver of it, and memory has to follow
+// those tiles rather than the board. Every step also reports the resident size of the process right after it,
+// and the raster save the size of its file, which grows with the tiles alone.
+void run_huge_outlines(Bench& bench){
+    Workload workload = {"huge_outlines", 1000000, 1000000, 4, 900000, 0, 0.0};
+    const vector<string> commands = {
+        "add square nofill red 900000 50000 950000",
+        "add circle nofill blue 450000 500000 500000",
+        "add triangle nofill green 400000 500000 900000",
+        "add line yellow 1000000 45 0 0",
+    };
+    string snapshot = "blackboard_bench_huge_outlines.bbs";
+    string after;
+    auto note = [&](const string& more = ""){
+        after = ",\"resident_kb\":" + to_string(resident_kb()) + more;
+    };
+
+    Blackboard blackboard(workload.width, workload.height);
+    Parser parser(&blackboard);
+    bench.measure("add_outline", workload, commands.size(), [&](){
+        for (auto& command : commands){
+            parser.parse_command(command);
+        }
+        note();
+    }, after);
+    bench.measure("draw", workload, 20, [&](){
+        for (int i = 0; i < 20; i++) blackboard.draw();
+        note();
+    }, after);
+    bench.measure("save_raster", workload, 1, [&](){
+        FileSystem(snapshot, &blackboard).save_binary(true);
+        struct stat info = {};
+        stat(snapshot.c_str(), &info);
+        note(",\"file_kb\":" + to_string(info.st_size / 1024));
+    }, after);
+    bench.measure("clear", workload, 1, [&](){
+        blackboard.clear();
+        note();
+    }, after);
+    remove(snapshot.c_str());
+}
+
+// The old sampling rasterizers, kept only to compare speed and coverage against the integer ones.
+void trig_circle(Framebuffer& framebuffer, const int& radius, const int& x, const int& y){
+    int up_bound = framebuffer.get_height();
+    int right_bound = framebuffer.get_width();
+    for (double t = 0.0; t < 6.3; t += 0.1){
+        int x_draw = (int)(radius * sin(t) + x);
+        int y_draw = (int)(radius * cos(t) + y);
+        if (x_draw > 0 && x_draw < right_bound && up_bound - y_draw > 0 && y_draw > 0){
+            framebuffer.put(x_draw, up_bound - y_draw - 1, '*', 1, 0);
+        }
+    }
+}
+
+void trig_line(Framebuffer& framebuffer, const int& length, const int& angle, const int& x, const int& y){
+    int up_bound = framebuffer.get_height();
+    int right_bound = framebuffer.get_width();
+    double rad_angle = angle * 3.14 / 180.0;
+    for (int i = 0; i < length; ++i){
+        int x_draw = x + (int)(i * cos(rad_angle));
+        int y_draw = y + (int)(i * sin(rad_angle));
+        if (x_draw > 0 && x_draw < right_bound && up_bound - y_draw > 0 && y_draw > 0){
+            framebuffer.put(x_draw, up_bound - y_draw - 1, '*', 1, 0);
+        }
+    }
+}
+
+// Draws one shape `rounds` times on a fresh board and also reports how many cells it sets, to show coverage.
+template <typename Draw>
+void shape_bench(Bench& bench, const string& name, const int& size, Draw draw){
+    const int rounds = 20;
+    int board = 2 * size + 8;
+    Workload workload = {"shape", board, board, 1, size, 0, 0.0};
+    Framebuffer framebuffer(board, board);
+    draw(framebuffer, board / 2);
+    size_t cells = 0;
+    for (int row = 0; row < board; row++){
+        for (int col = 0; col < board; col++){
+            cells += framebuffer.top_at(col, row) != -1;
+        }
+    }
+    bench.measure(name, workload, rounds, [&](){
+        for (int round = 0; round < rounds; round++){
+            framebuffer.clear();
+            draw(framebuffer, board / 2);
+        }
+    }, ",\"cells\":" + to_string(cells));
+}
+
+void run_shapes(Bench& bench){
+    for (int radius : {8, 64, 512, 2048}){
+        shape_bench(bench, "circle_trig", radius, [&](Framebuffer& framebuffer, const int& centre){
+            trig_circle(framebuffer, radius, centre, centre);
+        });
+        shape_bench(bench, "circle_midpoint", radius, [&](Framebuffer& framebuffer, const int& centre){
+            Figure(Circle(false, named_color("red"), radius, centre, centre, 0)).add(&framebuffer);
+        });
+        shape_bench(bench, "circle_midpoint_fill", radius, [&](Framebuffer& framebuffer, const int& centre){
+            Figure(Circle(true, named_color("red"), radius, centre, centre, 0)).add(&framebuffer);
+        });
+    }
+    for (int length : {16, 256, 4096}){
+        shape_bench(bench, "line_trig", length, [&](Framebuffer& framebuffer, const int&){
+            trig_line(framebuffer, length, 30, 4, 4);
+        });
+        shape_bench(bench, "line_bresenham", length, [&](Framebuffer& framebuffer, const int&){
+            Figure(Line(named_color("red"), length, 30, 4, 4, 0)).add(&framebuffer);
+        });
+    }
+    for (int height : {8, 64, 512}){
+        shape_bench(bench, "triangle_edge_walk", height, [&](Framebuffer& framebuffer, const int& centre){
+            Figure(Triangle(false, named_color("red"), height, centre, height + 2, 0)).add(&framebuffer);
+        });
+        shape_bench(bench, "triangle_edge_walk_fill", height, [&](Framebuffer& framebuffer, const int& centre){
+            Figure(Triangle(true, named_color("red"), height, centre, height + 2, 0)).add(&framebuffer);
+        });
+    }
+}
+
+int main(int argc, char* argv[]) {
+    ios::sync_with_stdio(false);
+    ostream report(cout.rdbuf());
+    Bench bench(report, argc > 1 ? argv[1] : "");
+    // First, so that the resident sizes it reports hold nothing left over from the other workloads.
+    run_huge_outlines(bench);
+    for (auto& workload : WORKLOADS){
+        run_workload(bench, workload);
+    }
+    run_shapes(bench);
+    return 0;
+}
+#else
+int main(int argc, char* argv[]) {
     Engine engine;
+    string script;
+    string socket_path;
+    string autosave_path;
+    int autosave_seconds = 30;
+
+    for (int i = 1; i < argc; i++){
+        string argument = argv[i];
+        int width, height;
+        char separator;
+
+        if (argument == "--size" && i + 1 < argc){
+            stringstream size(argv[++i]);
+            if (!(size >> width >> separator >> height) || separator != 'x' || !valid_board(width, height)){
+                cerr << "Board size must look like 90x50, with sides of at most " << MAX_COORDINATE << "\n";
+                return 1;
+            }
+            engine.set_size(width, height);
+        }
+        else if (argument == "--serve" && i + 1 < argc){
+            socket_path = argv[++i];
+        }
+        else if (argument == "--stats"){
+            engine.set_dump_stats(true);
+        }
+        else if (argument == "--journal" && i + 1 < argc){
+            engine.set_journal(argv[++i]);
+        }
+        else if (argument == "--autosave" && i + 1 < argc){
+            autosave_path = argv[++i];
+        }
+        else if (argument == "--autosave-interval" && i + 1 < argc){
+            autosave_seconds = atoi(argv[++i]);
+            if (autosave_seconds <= 0){
+                cerr << "Autosave interval must be a positive number of seconds\n";
+                return 1;
+            }
+        }
+        else if (argument == "--threads" && i + 1 < argc){
+            int threads = atoi(argv[++i]);
+            if (threads <= 0){
+                cerr << "Thread count must be a positive number\n";
+                return 1;
+            }
+            engine.set_threads(threads);
+        }
+        else script = argument;
+    }
 
-    engine.run();
+    if (!autosave_path.empty()) engine.set_autosave(autosave_path, autosave_seconds);
+
+    if (!socket_path.empty()){
+        return engine.serve(socket_path) ? 0 : 1;
+    }
+    if (!script.empty() || !isatty(STDIN_FILENO)){
+        ios::sync_with_stdio(false);
+        engine.run_batch(script.empty() ? "-" : script);
+    }
+    else engine.run();
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
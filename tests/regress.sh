@@ -0,0 +1,270 @@
+#!/bin/sh
+# Regression checks: builds blackboard.cpp with $CXX (g++ by default) and compares outputs that have to agree.
+#
+#     tests/regress.sh
+#
+# Prints one line per check and exits non-zero if any of them fails. The checks that talk to a server over a Unix
+# socket need python3.
+set -u
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+server=
+trap '[ -n "$server" ] && kill "$server" 2>/dev/null; rm -rf "$work"' EXIT
+
+CXX=${CXX:-g++}
+bb=$work/blackboard
+$CXX -std=c++17 -O2 -pthread -o "$bb" "$root/blackboard.cpp" || exit 1
+
+failures=0
+check(){
+    if [ "$2" -eq 0 ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        failures=$((failures + 1))
+    fi
+}
+
+# Board size for every check; the figure count is above the threshold for parallel rebuilds.
+size=600x400
+figures=2000
+
+# Adds of every shape with a selection and an edit, paint, remove, undo or redo after about every eighth one.
+# The seed is fixed, so all runs below see the same commands.
+awk -v n=$figures -v seed=7 -v w=600 -v h=400 '
+function r(k){ return int(rand() * k) }
+BEGIN{
+    srand(seed)
+    split("red green blue yellow cyan magenta", colors, " ")
+    split("square circle triangle", shapes, " ")
+    for (i = 0; i < n; i++){
+        kind = r(4)
+        color = colors[1 + r(6)]
+        if (kind == 3) print "add line " color " " 1 + r(60) " " r(360) " " r(w) " " r(h)
+        else print "add " shapes[1 + kind] " " (r(2) ? "fill" : "frame") " " color " " 1 + r(20) " " r(w) " " r(h)
+        if (r(8) == 0){
+            print "select " r(w) " " r(h)
+            step = r(5)
+            if (step == 0) print "remove"
+            else if (step == 1) print "edit " 1 + r(25)
+            else if (step == 2) print "paint " colors[1 + r(6)]
+            else if (step == 3) print "undo"
+            else print "redo"
+        }
+    }
+}' > "$work/edits.txt"
+
+# Parallel rebuilds draw the same cells as a serial one.
+(cat "$work/edits.txt"; echo "save $work/threads1.bbs raster") | "$bb" --size $size --threads 1 > /dev/null 2>&1
+(cat "$work/edits.txt"; echo "save $work/threads8.bbs raster") | "$bb" --size $size --threads 8 > /dev/null 2>&1
+cmp -s "$work/threads1.bbs" "$work/threads8.bbs"
+check "raster with --threads 1 equals --threads 8" $?
+
+# Runs the commands in a file through a server on a board of $size and prints its replies.
+serve(){
+    rm -f "$work/socket"
+    "$bb" --size $size --serve "$work/socket" > /dev/null 2>&1 &
+    server=$!
+    python3 - "$work/socket" "$1" <<'EOF'
+import os, socket, sys, time
+path, script = sys.argv[1], sys.argv[2]
+for _ in range(200):
+    if os.path.exists(path): break
+    time.sleep(0.05)
+client = socket.socket(socket.AF_UNIX)
+client.connect(path)
+def prompt():
+    data = b''
+    while not data.endswith(b'Enter command: '):
+        chunk = client.recv(65536)
+        if not chunk: break
+        data += chunk
+    sys.stdout.write(data.decode(errors='replace'))
+prompt()
+for line in open(script).read().splitlines():
+    client.sendall((line + '\n').encode())
+    prompt()
+client.sendall(b'exit\n')
+EOF
+    kill "$server" 2>/dev/null
+    wait "$server" 2>/dev/null
+    server=
+}
+
+# A server applies every command to the raster as it goes, recomposing after removes and edits; loading its
+# figures in a batch rebuilds the raster from scratch.
+(cat "$work/edits.txt"; echo "save $work/incremental.bbs raster"; echo "save $work/figures.bbs binary") > "$work/session.txt"
+serve "$work/session.txt" > /dev/null
+printf 'load %s\nsave %s raster\n' "$work/figures.bbs" "$work/rebuilt.bbs" | "$bb" --size $size > /dev/null 2>&1
+cmp -s "$work/incremental.bbs" "$work/rebuilt.bbs"
+check "incremental recompose equals a full rebuild" $?
+
+# A bulk insert as big as the board rebuilds it once; undoing past it and the commands before it still replays their
+# cells, so the number of rebuilds in the stats does not move.
+{
+    head -n 200 "$work/edits.txt"
+    echo begin
+    awk 'BEGIN{ for (i = 0; i < 400; i++) print "add circle fill cyan " 1 + i % 8 " " 20 + i % 20 * 28 " " 20 + int(i / 20) * 18 }'
+    echo commit
+    sed -n '601,700p' "$work/edits.txt"
+    echo stats
+    echo "undo 100"
+    echo "redo 30"
+    echo "undo 10"
+    echo stats
+    echo "save $work/replayed.bbs raster"
+    echo "save $work/replayed-figures.bbs binary"
+} > "$work/rebuilds.txt"
+rebuilds=$(serve "$work/rebuilds.txt" | awk '$1 == "rebuild" && $2 == "count" { printf "%s ", $3 }')
+[ "$rebuilds" = "1, 1, " ]
+check "undo and redo after a rebuild replay cells" $?
+printf 'load %s\nsave %s raster\n' "$work/replayed-figures.bbs" "$work/replayed-rebuilt.bbs" | "$bb" --size $size > /dev/null 2>&1
+cmp -s "$work/replayed.bbs" "$work/replayed-rebuilt.bbs"
+check "replayed cells equal a full rebuild" $?
+
+# Replaying the journal gives the board the session left behind in its last autosave.
+"$bb" --size $size --journal "$work/journal" --autosave "$work/autosave.bbs" < "$work/edits.txt" > /dev/null 2>&1
+echo "save $work/recovered.bbs raster" | "$bb" --size $size --journal "$work/journal" > /dev/null 2>&1
+cmp -s "$work/autosave.bbs" "$work/recovered.bbs"
+check "journal recovery equals the final autosave" $?
+
+# Writes a little-endian int32 into a file at a byte offset.
+put_int(){
+    value=$(($3 & 0xffffffff))
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $((value & 255)) $((value >> 8 & 255)) $((value >> 16 & 255)) $((value >> 24)))" |
+        dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# Snapshot files whose version, ids or figures are wrong are refused and leave the board as it was. Offsets follow
+# SnapshotHeader (24 bytes, next_id last) and FigureRecord (24 bytes: id at 4, size, x and y from 8).
+printf 'add square fill red 3 10 20\nadd circle frame blue 2 40 20\nsave %s binary\n' "$work/good.bbs" | "$bb" > /dev/null 2>&1
+second=48
+for case in negative duplicate huge above outside version; do
+    fault="a $case id"
+    cp "$work/good.bbs" "$work/$case.bbs"
+    case $case in
+        negative) put_int "$work/$case.bbs" $((second + 4)) -5 ;;
+        duplicate) put_int "$work/$case.bbs" $((second + 4)) 0 ;;
+        huge) put_int "$work/$case.bbs" $((second + 4)) 2000000000; put_int "$work/$case.bbs" 20 2000000001 ;;
+        above) put_int "$work/$case.bbs" $((second + 4)) 7; fault="an id at or above next_id" ;;
+        outside) put_int "$work/$case.bbs" $((second + 16)) 500; fault="a figure outside the board" ;;
+        version) put_int "$work/$case.bbs" 4 2; fault="an earlier format version" ;;
+    esac
+    printf 'add square fill green 5 50 30\nsave %s\nload %s\nsave %s\n' "$work/before.txt" "$work/$case.bbs" "$work/after.txt" |
+        "$bb" > /dev/null 2>&1
+    cmp -s "$work/before.txt" "$work/after.txt"
+    check "snapshot with $fault is refused" $?
+done
+printf 'load %s\nsave %s\n' "$work/good.bbs" "$work/loaded.txt" | "$bb" > /dev/null 2>&1
+grep -q Circle "$work/loaded.txt"
+check "unmodified snapshot loads" $?
+
+# Boards wider or taller than figure coordinates reach are refused, on the command line and in a text file.
+"$bb" --size 2147483647x2147483647 < /dev/null > /dev/null 2>&1
+[ $? -ne 0 ]
+check "oversized --size is refused" $?
+printf 'Board: size( 2147483647,2147483647 )\nSquare: id(0), size( 3 ), coordinates( 10,20 ), color( r ), filled( yes )\n' > "$work/huge.txt"
+printf 'add square fill green 5 50 30\nsave %s\nload %s\nsave %s\n' "$work/before.txt" "$work/huge.txt" "$work/after.txt" |
+    "$bb" > /dev/null 2>&1
+cmp -s "$work/before.txt" "$work/after.txt"
+check "text file with an oversized board is refused" $?
+
+# Squares are placed by the rows they are drawn on, y down to y - size + 1: one running past the bottom or lying
+# wholly off a side is refused, one reaching up to the top row fits, and one partly off a side is kept.
+printf '%s\n' 'add square fill red 5 10 2' 'add square fill red 5 10 48' 'add square fill red 5 -10 20' \
+    'add square frame blue 5 88 20' "save $work/squares.txt" | "$bb" > /dev/null 2>&1
+printf '%s\n' 'Board: size( 90,50 )' \
+    'Square: id(1), size( 5 ), coordinates( 10,48 ), color( r ), filled( yes )' \
+    'Square: id(3), size( 5 ), coordinates( 88,20 ), color( b ), filled( no )' > "$work/squares-expected.txt"
+cmp -s "$work/squares.txt" "$work/squares-expected.txt"
+check "squares are placed by the rows they cover" $?
+
+# Extended colors are written by name in lower case, and misspelled ones are refused; a snapshot carries them into
+# a process whose palette numbers them differently.
+printf '%s\n' 'add square fill color9 3 10 20' 'add circle frame #FF8000 4 30 20' 'add line color255 10 0 40 10' \
+    'add square fill color256 3 50 20' 'add square fill color09 3 55 20' 'add square fill #12345 3 60 20' \
+    'add triangle fill color0 4 70 30' "save $work/palette.txt" "save $work/palette.bbs binary" | "$bb" > /dev/null 2>&1
+printf '%s\n' 'Board: size( 90,50 )' \
+    'Square: id(0), size( 3 ), coordinates( 10,20 ), color( color9 ), filled( yes )' \
+    'Circle: id(1), radius( 4 ), coordinates( 30,20 ), color( #ff8000 ), filled( no )' \
+    'Line: id(2), length( 10 ), angle( 0 ), coordinates( 40,10 ), color( color255 )' \
+    'Triangle: id(3), height( 4 ), coordinates( 70,30 ), color( color0 ), filled( yes )' > "$work/palette-expected.txt"
+cmp -s "$work/palette.txt" "$work/palette-expected.txt"
+check "extended color names parse and print" $?
+printf 'add square fill #00ff00 2 5 5\nload %s\nsave %s\n' "$work/palette.bbs" "$work/palette-loaded.txt" | "$bb" > /dev/null 2>&1
+cmp -s "$work/palette.txt" "$work/palette-loaded.txt"
+check "extended colors survive a snapshot into another palette" $?
+
+# Text files with a damaged line are refused whole and leave the board as it was.
+good='Square: id(0), size( 3 ), coordinates( 10,20 ), color( r ), filled( yes )'
+for case in kind field number color extended header size; do
+    case $case in
+        kind) bad='Hexagon: id(1), size( 3 ), coordinates( 30,20 ), color( r ), filled( yes )' ;;
+        field) bad='Square: id(1), coordinates( 30,20 ), color( r ), filled( yes )' ;;
+        number) bad='Square: id(1), size( 3x ), coordinates( 30,20 ), color( r ), filled( yes )' ;;
+        color) bad='Square: id(1), size( 3 ), coordinates( 30,20 ), color( q ), filled( yes )' ;;
+        extended) bad='Square: id(1), size( 3 ), coordinates( 30,20 ), color( color300 ), filled( yes )' ;;
+        header) bad='Board: size( 90,50 )' ;;
+        size) bad='Square: id(1), size( 0 ), coordinates( 30,20 ), color( r ), filled( yes )' ;;
+    esac
+    printf 'Board: size( 90,50 )\n%s\n%s\n' "$good" "$bad" > "$work/$case.txt"
+    printf 'add square fill green 5 50 30\nsave %s\nload %s\nsave %s\n' "$work/before.txt" "$work/$case.txt" "$work/after.txt" |
+        "$bb" > /dev/null 2>&1
+    cmp -s "$work/before.txt" "$work/after.txt"
+    check "text file with a bad $case is refused" $?
+done
+
+# Figures outside the board and duplicates are skipped, and a line starting with 0 ends the file.
+printf '%s\n' 'Board: size( 90,50 )' "$good" \
+    'Square: id(5), size( 3 ), coordinates( 10,1 ), color( r ), filled( yes )' \
+    'Square: id(6), size( 3 ), coordinates( 10,20 ), color( b ), filled( no )' \
+    'Line: id(7), length( 12 ), angle( 90 ), coordinates( 30,10 ), color( color42 )' 0 \
+    'Square: id(8), size( 3 ), coordinates( 50,20 ), color( r ), filled( yes )' > "$work/skipped.txt"
+printf 'load %s\nsave %s\n' "$work/skipped.txt" "$work/skipped-loaded.txt" | "$bb" > /dev/null 2>&1
+printf '%s\n' 'Board: size( 90,50 )' "$good" \
+    'Line: id(3), length( 12 ), angle( 90 ), coordinates( 30,10 ), color( color42 )' > "$work/skipped-expected.txt"
+cmp -s "$work/skipped-loaded.txt" "$work/skipped-expected.txt"
+check "text loader skips what does not fit and stops at 0" $?
+
+# A script run in batch mode prints what a server replies to the same commands, less the prompts, though it only
+# rasterizes for the draws; piped commands print the same.
+(head -n 200 "$work/edits.txt"; echo draw; sed -n '201,260p' "$work/edits.txt"; echo list; echo draw) > "$work/script.txt"
+"$bb" --size $size "$work/script.txt" > "$work/script.out" 2> /dev/null
+"$bb" --size $size < "$work/script.txt" > "$work/piped.out" 2> /dev/null
+serve "$work/script.txt" | sed 's/Enter command: //g' > "$work/served.out"
+cmp -s "$work/script.out" "$work/served.out" && cmp -s "$work/script.out" "$work/piped.out"
+check "batch output equals a server's replies without prompts" $?
+
+# Stats count every command and histogram the cells each rasterization wrote: 9 and 16 for the squares, 28 for the
+# circle. Latencies vary from run to run, so only counts and sizes are compared.
+printf 'add square fill red 3 10 20\nadd square fill red 4 20 20\nadd circle frame blue 5 40 20\nundo\nstats\n' > "$work/stats.txt"
+serve "$work/stats.txt" | sed 's/Enter command: //g' |
+    awk '$2 == "count" { print $1, $2, $3; next } /cells:|^Board:|^History:/' > "$work/stats.out"
+printf '%s\n' 'add count 3,' 'undo count 1,' 'rasterize count 3,' 'undo count 1,' \
+    '  rasterize cells: mean 17, p99 28, max 28' \
+    'Board: 600x400, 2 figures, 4 tiles (1024 cells) using 97 KB, 53 cells written' \
+    'History: 2 undo and 1 redo steps using 1 KB of 65536 KB' > "$work/stats-expected.txt"
+cmp -s "$work/stats.out" "$work/stats-expected.txt"
+check "stats count commands and cells written" $?
+
+# Clears and loads while undo still holds figures off the board leave nothing of them behind, and a load keeps the
+# figures it read: the commands after it save the same figures as after the same load on a fresh board, ids aside.
+(head -n 300 "$work/edits.txt"; echo "undo 40"; echo "redo 10"; echo clear; sed -n '301,400p' "$work/edits.txt"
+    echo "undo 20"; echo "load $work/figures.bbs"; sed -n '401,600p' "$work/edits.txt"; echo "save $work/cleared.txt") |
+    "$bb" --size $size > /dev/null 2>&1
+(echo "load $work/figures.bbs"; sed -n '401,600p' "$work/edits.txt"; echo "save $work/fresh.txt") | "$bb" --size $size > /dev/null 2>&1
+sed 's/id([0-9]*)//' "$work/cleared.txt" > "$work/cleared-figures.txt"
+sed 's/id([0-9]*)//' "$work/fresh.txt" > "$work/fresh-figures.txt"
+cmp -s "$work/cleared-figures.txt" "$work/fresh-figures.txt"
+check "clear and load after undo equal a fresh load" $?
+
+# Clearing the board gives back the extended colors its figures used, so another 245 can be named afterwards.
+colors(){
+    awk -v base=$1 'BEGIN{ for (i = 0; i < 245; i++) printf "add square fill #%06x 1 %d %d\n", base + i, 1 + i % 40 * 2, 1 + int(i / 40) * 2 }'
+}
+(colors 0; echo clear; colors 4096; echo "save $work/recolored.txt") | "$bb" > /dev/null 2>&1
+[ "$(grep -c 'color( #001' "$work/recolored.txt")" -eq 245 ]
+check "cleared extended colors are reused" $?
+
+[ $failures -eq 0 ]